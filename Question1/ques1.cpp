@@ -7,6 +7,20 @@
 #include <chrono>
 #include <climits>
 #include <iomanip>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <streambuf>
+#include <thread>
 class LibraryItem
 {        
 protected:
@@ -15,7 +29,7 @@ protected:
 
 public:
     LibraryItem(const std::string &id) : identifier(id) {}
-    virtual void displayInfo() const = 0;
+    virtual void displayInfo(std::ostream &out = std::cout) const = 0;
     virtual std::string getIdentifier() const
     {
         return identifier;
@@ -31,9 +45,9 @@ protected:
 public:
     PhysicalItem(const std::string &id, const std::string &loc, const std::string &duration)
         : LibraryItem(id), location(loc), returnDuration(duration) {}
-    virtual void displayInfo() const override
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        std::cout << "Identifier: " << identifier << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
+        out << "Identifier: " << identifier << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
     }
 
     std::string getIdentifier() const override
@@ -50,9 +64,9 @@ protected:
 public:
     ElectronicItem(const std::string &id, const std::string &link)
         : LibraryItem(id), accessLink(link) {}
-    virtual void displayInfo() const override
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        std::cout << "Identifier: " << identifier << ", Access Link: " << accessLink << "\n";
+        out << "Identifier: " << identifier << ", Access Link: " << accessLink << "\n";
     }
 
     std::string getIdentifier() const override
@@ -74,10 +88,10 @@ public:
          int cnt, const std::string &isbnVal, const std::string &auth, const std::string &titleVal)
         : PhysicalItem(id, loc, duration), count(cnt), isbn(isbnVal), authors(auth), title(titleVal) {}
 
-    virtual void displayInfo() const override
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        PhysicalItem::displayInfo();
-        std::cout << "Type: Book, Count: " << count << " ISBN: " << isbn << " Authors: " << authors << " Title: " << title << "\n";
+        PhysicalItem::displayInfo(out);
+        out << "Type: Book, Count: " << count << " ISBN: " << isbn << " Authors: " << authors << " Title: " << title << "\n";
     }
 
     std::string getIdentifier() const override
@@ -95,9 +109,9 @@ public:
     Magazine(const std::string &id, const std::string &loc, const std::string &duration, const std::string &pub)
         : PhysicalItem(id, loc, duration), publication(pub) {}
 
-    virtual void displayInfo() const override
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        std::cout << "Identifier: " << getPublication() << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
+        out << "Identifier: " << getPublication() << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
     }
 
     std::string getPublication() const
@@ -125,9 +139,9 @@ public:
     Journal(const std::string &id, const std::string &loc, const std::string &duration, const std::string &name)
         : PhysicalItem(id, loc, duration), journalName(name) {}
 
-    virtual void displayInfo() const override
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        std::cout << "Identifier: " << journalName << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
+        out << "Identifier: " << journalName << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
     }
 
     std::string getIdentifier() const override
@@ -136,64 +150,901 @@ public:
     }
 };
 
+// Mixes a 64-bit value so that nearby inputs spread over all bits.
+inline uint64_t mixHash(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t hashString(const std::string &value)
+{
+    return mixHash(std::hash<std::string>()(value));
+}
+
+// Compact set of identifiers that can say "definitely not in the catalog"
+// without touching the catalog. It may wrongly say "maybe" (about 1% of the
+// time while not saturated) but never misses an identifier that was added.
+class BloomFilter
+{
+private:
+    static const int hashCount = 7;
+    std::vector<uint64_t> words;
+    uint64_t bitMask;
+    size_t itemCount;
+    size_t capacity;
+
+public:
+    // Uses about 10 bits per expected identifier.
+    BloomFilter(size_t expectedItems = 1024) : itemCount(0), capacity(std::max<size_t>(expectedItems, 64))
+    {
+        size_t bits = 64;
+        while (bits < capacity * 10)
+            bits <<= 1;
+        words.assign(bits / 64, 0);
+        bitMask = bits - 1;
+    }
+
+    void add(const std::string &value)
+    {
+        uint64_t h1 = hashString(value);
+        uint64_t h2 = mixHash(h1) | 1;
+        for (int i = 0; i < hashCount; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) & bitMask;
+            words[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        ++itemCount;
+    }
+
+    bool mightContain(const std::string &value) const
+    {
+        uint64_t h1 = hashString(value);
+        uint64_t h2 = mixHash(h1) | 1;
+        for (int i = 0; i < hashCount; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) & bitMask;
+            if (!(words[bit >> 6] & (1ULL << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    // True once more identifiers were added than the filter was sized for.
+    bool isSaturated() const
+    {
+        return itemCount > capacity;
+    }
+};
+
+enum UserType
+{
+    StudentUser,
+    FacultyUser,
+    UserTypeCount
+};
+
+enum ItemType
+{
+    BookItem, MagazineItem, JournalItem, ItemTypeCount
+};
+
+const char *itemTypeName(ItemType type)
+{
+    static const char *const names[] = {"Book", "Magazine", "Journal"};
+    return names[type];
+}
+
+struct LoanPolicy
+{
+    std::chrono::hours loanPeriod;
+    int maxItems; // Items of this type a user may hold at once
+    int maxRenewals;
+};
+
+// Loan rules for every (branch, user type, item type), compiled from a rules
+// file into one flat table, so each borrow finds its rule by index alone.
+class LoanPolicyTable
+{
+private:
+    std::vector<std::string> branches;
+    std::vector<LoanPolicy> policies;
+
+    static size_t slot(size_t branch, UserType user, ItemType item)
+    {
+        return (branch * UserTypeCount + user) * ItemTypeCount + item;
+    }
+
+    // Returns -1 for "*", the matching index, or -2 if the name is unknown.
+    static int parseName(const std::string &name, const char *const names[], int count)
+    {
+        if (name == "*")
+            return -1;
+        for (int i = 0; i < count; ++i)
+        {
+            if (name == names[i])
+                return i;
+        }
+        return -2;
+    }
+
+public:
+    // Defaults: students keep items for 30 days, faculty for 6 months.
+    LoanPolicyTable() : branches(1, "main")
+    {
+        LoanPolicy student = {std::chrono::hours(24 * 30), 10, 2};
+        LoanPolicy faculty = {std::chrono::hours(24 * 30 * 6), 50, 4};
+        for (int item = 0; item < ItemTypeCount; ++item)
+            policies.push_back(student);
+        for (int item = 0; item < ItemTypeCount; ++item)
+            policies.push_back(faculty);
+    }
+
+    // Reads "user_type,item_type,branch,loan_days,max_items,max_renewals" rows,
+    // where "*" matches every value. Later rows override earlier ones.
+    bool load(const std::string &filename)
+    {
+        std::ifstream file(filename);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open file: " << filename << "\n";
+            return false;
+        }
+
+        static const char *const userNames[] = {"student", "faculty"};
+        static const char *const itemNames[] = {"book", "magazine", "journal"};
+
+        struct Rule
+        {
+            int user, item, branch;
+            LoanPolicy policy;
+        };
+        std::vector<Rule> rules;
+
+        std::string line;
+        int lineNum = 0;
+        while (std::getline(file, line))
+        {
+            ++lineNum;
+            if (lineNum == 1 && line.compare(0, 9, "user_type") == 0)
+                continue;
+
+            std::istringstream iss(line);
+            std::string user, item, branch, days, maxItems, maxRenewals;
+            if (!std::getline(iss, user, ',') || !std::getline(iss, item, ',') || !std::getline(iss, branch, ',') ||
+                !std::getline(iss, days, ',') || !std::getline(iss, maxItems, ',') || !std::getline(iss, maxRenewals, ','))
+            {
+                std::cerr << "Invalid line format at line " << lineNum << "\n";
+                continue;
+            }
+
+            Rule rule;
+            rule.user = parseName(user, userNames, UserTypeCount);
+            rule.item = parseName(item, itemNames, ItemTypeCount);
+            if (rule.user == -2 || rule.item == -2)
+            {
+                std::cerr << "Unknown user or item type at line " << lineNum << "\n";
+                continue;
+            }
+            int loanDays;
+            try
+            {
+                loanDays = std::stoi(days);
+                rule.policy.maxItems = std::stoi(maxItems);
+                rule.policy.maxRenewals = std::stoi(maxRenewals);
+            }
+            catch (const std::exception &)
+            {
+                std::cerr << "Invalid number at line " << lineNum << "\n";
+                continue;
+            }
+            if (loanDays < 0 || loanDays > INT_MAX / 24 || rule.policy.maxItems < 0 || rule.policy.maxRenewals < 0)
+            {
+                std::cerr << "Loan days, item limit or renewals out of range at line " << lineNum << "\n";
+                continue;
+            }
+            rule.policy.loanPeriod = std::chrono::hours(24 * loanDays);
+
+            rule.branch = -1;
+            if (branch != "*")
+            {
+                rule.branch = branchIndex(branch);
+                if (rule.branch < 0)
+                {
+                    rule.branch = branches.size();
+                    branches.push_back(branch);
+                    // Copied first: inserting a range of a vector into itself is undefined
+                    std::vector<LoanPolicy> defaults(policies.begin(), policies.begin() + UserTypeCount * ItemTypeCount);
+                    policies.insert(policies.end(), defaults.begin(), defaults.end());
+                }
+            }
+            rules.push_back(rule);
+        }
+        file.close();
+
+        for (const auto &rule : rules)
+        {
+            for (size_t b = 0; b < branches.size(); ++b)
+                for (int u = 0; u < UserTypeCount; ++u)
+                    for (int i = 0; i < ItemTypeCount; ++i)
+                    {
+                        if ((rule.branch < 0 || rule.branch == static_cast<int>(b)) && (rule.user < 0 || rule.user == u) && (rule.item < 0 || rule.item == i))
+                            policies[slot(b, static_cast<UserType>(u), static_cast<ItemType>(i))] = rule.policy;
+                    }
+        }
+        return true;
+    }
+
+    // Returns -1 if the branch has no rules of its own.
+    int branchIndex(const std::string &name) const
+    {
+        for (size_t b = 0; b < branches.size(); ++b)
+        {
+            if (branches[b] == name)
+                return b;
+        }
+        return -1;
+    }
+
+    const LoanPolicy &lookup(UserType user, ItemType item, size_t branch = 0) const
+    {
+        return policies[slot(branch, user, item)];
+    }
+};
+
+const LoanPolicyTable &defaultLoanPolicies()
+{
+    static const LoanPolicyTable defaults;
+    return defaults;
+}
+
+// One item a user has borrowed, with the due date fixed by the policy at borrow time.
+struct LoanRecord
+{
+    std::chrono::system_clock::time_point borrowedAt;
+    std::chrono::system_clock::time_point dueAt;
+    ItemType type;
+    int renewals;
+};
+
+// Users and their loans kept in a memory-mapped file, so they survive restarts
+// without being read back in. The file holds a header, a fixed-size hash table
+// of users and a growable table of loans. Each user links to its loans through
+// a chain of loan indexes. A record is written in full before anything points
+// to it, so a crash can only leave an unused record behind, never a broken link.
+class UserStore
+{
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t userCapacity;
+        uint32_t loanCapacity;
+        uint32_t loanCount;
+    };
+
+    struct StoredUser
+    {
+        uint64_t nameHash;
+        char username[48];
+        int32_t firstLoan;
+        uint8_t isStudent;
+        uint8_t inUse;
+        uint8_t padding[2];
+    };
+
+    struct StoredLoan
+    {
+        char itemIdentifier[96];
+        int64_t borrowedTime;
+        int64_t returnTime;
+        int32_t nextLoan;
+        int32_t userSlot;
+        uint8_t itemType;
+        uint8_t renewals;
+        uint8_t padding[6];
+    };
+
+    // Loan record of version 1 files, which had no borrow date, type or renewals.
+    struct StoredLoanVersion1
+    {
+        char itemIdentifier[112];
+        int64_t returnTime;
+        int32_t nextLoan;
+        int32_t userSlot;
+    };
+
+    static const uint32_t storeVersion = 2;
+    static const uint32_t initialUserCapacity = 1 << 12;
+    static const uint32_t initialLoanCapacity = 1 << 16;
+
+    int fd;
+    char *base;
+    size_t mappedSize;
+    std::string path;
+    long userCount; // Users in the table, or -1 until it is first needed
+
+    Header *header() const
+    {
+        return reinterpret_cast<Header *>(base);
+    }
+
+    StoredUser *users() const
+    {
+        return reinterpret_cast<StoredUser *>(base + sizeof(Header));
+    }
+
+    StoredLoan *loans() const
+    {
+        return reinterpret_cast<StoredLoan *>(base + sizeof(Header) + sizeof(StoredUser) * header()->userCapacity);
+    }
+
+    static size_t fileSize(uint32_t userCapacity, uint32_t loanCapacity)
+    {
+        return sizeof(Header) + sizeof(StoredUser) * userCapacity + sizeof(StoredLoan) * static_cast<size_t>(loanCapacity);
+    }
+
+    // Writes the pages holding [start, start + length) to the file before returning,
+    // so later writes that point at this data never reach the disk before it.
+    void flush(const void *start, size_t length) const
+    {
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t offset = static_cast<const char *>(start) - base;
+        size_t first = offset / pageSize * pageSize;
+        msync(base + first, offset + length - first, MS_SYNC);
+    }
+
+    // Initializes an empty file. The magic is written and flushed last, so a
+    // crash part way leaves a file without magic, which open() recreates.
+    bool create()
+    {
+        size_t size = fileSize(initialUserCapacity, initialLoanCapacity);
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 || !mapFile(size))
+        {
+            std::cerr << "Failed to create user store: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        header()->version = storeVersion;
+        header()->userCapacity = initialUserCapacity;
+        header()->loanCapacity = initialLoanCapacity;
+        header()->loanCount = 0;
+        flush(header(), sizeof(Header));
+        std::memcpy(header()->magic, "LIBUSERS", 8);
+        flush(header(), sizeof(Header));
+        userCount = 0;
+        return true;
+    }
+
+    static bool copyFile(const std::string &from, const std::string &to)
+    {
+        std::ifstream source(from, std::ios::binary);
+        std::ofstream target(to, std::ios::binary | std::ios::trunc);
+        target << source.rdbuf();
+        return source.good() && target.good();
+    }
+
+    // Rewrites version 1 loans in place; both records are 128 bytes. Version 1
+    // kept no type or borrow date, so loans become books borrowed one default
+    // loan period before their due date. The file is copied to filename.v1
+    // first and restored from it if an earlier migration was interrupted.
+    bool migrateFromVersion1(const std::string &filename)
+    {
+        static_assert(sizeof(StoredLoanVersion1) == sizeof(StoredLoan), "loan records must keep their size");
+
+        size_t size = mappedSize;
+        munmap(base, mappedSize);
+        base = nullptr;
+
+        std::string backup = filename + ".v1";
+        bool restoring = std::ifstream(backup).good();
+        if (!(restoring ? copyFile(backup, filename) : copyFile(filename, backup)) || !mapFile(size))
+        {
+            std::cerr << "Failed to migrate user store " << filename << ".\n";
+            return false;
+        }
+        if (fileSize(header()->userCapacity, header()->loanCapacity) > mappedSize)
+        {
+            std::cerr << "User store " << filename << " is not valid.\n";
+            return false;
+        }
+
+        std::cerr << "Migrating user store " << filename << " from version 1; existing loans are recorded as books.\n";
+        for (uint32_t index = 0; index < header()->loanCount; ++index)
+        {
+            StoredLoanVersion1 old;
+            std::memcpy(&old, &loans()[index], sizeof(old));
+
+            StoredLoan &loan = loans()[index];
+            std::memset(&loan, 0, sizeof(loan));
+            size_t length = strnlen(old.itemIdentifier, sizeof(old.itemIdentifier));
+            if (length >= sizeof(loan.itemIdentifier))
+            {
+                std::cerr << "Loan identifier shortened to fit: " << std::string(old.itemIdentifier, length) << "\n";
+                length = sizeof(loan.itemIdentifier) - 1;
+            }
+            std::memcpy(loan.itemIdentifier, old.itemIdentifier, length);
+
+            bool student = old.userSlot >= 0 && static_cast<uint32_t>(old.userSlot) < header()->userCapacity && users()[old.userSlot].isStudent;
+            loan.returnTime = old.returnTime;
+            loan.borrowedTime = old.returnTime - toSeconds(std::chrono::system_clock::time_point(
+                                                     defaultLoanPolicies().lookup(student ? StudentUser : FacultyUser, BookItem).loanPeriod));
+            loan.nextLoan = old.nextLoan;
+            loan.userSlot = old.userSlot;
+            loan.itemType = BookItem;
+        }
+        flush(loans(), sizeof(StoredLoan) * header()->loanCount);
+
+        header()->version = storeVersion;
+        flush(header(), sizeof(Header));
+        std::remove(backup.c_str());
+        return true;
+    }
+
+    bool mapFile(size_t size)
+    {
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            std::cerr << "Failed to map user store: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        base = static_cast<char *>(mapped);
+        mappedSize = size;
+        return true;
+    }
+
+    // Doubles the loan table. The new space is zero-filled by ftruncate.
+    bool growLoans()
+    {
+        uint32_t newCapacity = header()->loanCapacity * 2;
+        size_t newSize = fileSize(header()->userCapacity, newCapacity);
+        if (ftruncate(fd, newSize) != 0)
+        {
+            std::cerr << "Failed to grow user store: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        munmap(base, mappedSize);
+        if (!mapFile(newSize))
+            return false;
+        header()->loanCapacity = newCapacity;
+        flush(header(), sizeof(Header));
+        return true;
+    }
+
+    long findSlot(const std::string &username, bool forInsert) const
+    {
+        uint32_t capacity = header()->userCapacity;
+        uint64_t hash = hashName(username);
+        for (uint32_t probe = 0; probe < capacity; ++probe)
+        {
+            uint32_t slot = (hash + probe) & (capacity - 1);
+            const StoredUser &user = users()[slot];
+            if (!user.inUse)
+                return forInsert ? static_cast<long>(slot) : -1;
+            if (user.nameHash == hash && username == user.username)
+                return slot;
+        }
+        return -1;
+    }
+
+    long countUsers() const
+    {
+        long count = 0;
+        for (uint32_t slot = 0; slot < header()->userCapacity; ++slot)
+            count += users()[slot].inUse ? 1 : 0;
+        return count;
+    }
+
+    // Rebuilds the store with twice the user slots in path.grow, then renames
+    // it over path, so a crash leaves either the old store or the complete
+    // new one. Users are placed again by hash; loans are copied unchanged
+    // except for the user slot they point back to.
+    bool growUsers()
+    {
+        uint32_t oldCapacity = header()->userCapacity;
+        uint32_t newCapacity = oldCapacity * 2;
+        if (newCapacity <= oldCapacity)
+            return false;
+
+        std::string growPath = path + ".grow";
+        size_t newSize = fileSize(newCapacity, header()->loanCapacity);
+        int newFd = ::open(growPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (newFd < 0 || flock(newFd, LOCK_EX | LOCK_NB) != 0 || ftruncate(newFd, newSize) != 0)
+        {
+            std::cerr << "Failed to grow user store: " << std::strerror(errno) << "\n";
+            if (newFd >= 0)
+                close(newFd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, newFd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            std::cerr << "Failed to grow user store: " << std::strerror(errno) << "\n";
+            close(newFd);
+            return false;
+        }
+
+        char *newBase = static_cast<char *>(mapped);
+        Header *newHeader = reinterpret_cast<Header *>(newBase);
+        StoredUser *newUsers = reinterpret_cast<StoredUser *>(newBase + sizeof(Header));
+        StoredLoan *newLoans = reinterpret_cast<StoredLoan *>(newBase + sizeof(Header) + sizeof(StoredUser) * newCapacity);
+
+        std::vector<int32_t> newSlotOf(oldCapacity, -1);
+        for (uint32_t slot = 0; slot < oldCapacity; ++slot)
+        {
+            const StoredUser &user = users()[slot];
+            if (!user.inUse)
+                continue;
+            uint32_t target = user.nameHash & (newCapacity - 1);
+            while (newUsers[target].inUse)
+                target = (target + 1) & (newCapacity - 1);
+            newUsers[target] = user;
+            newSlotOf[slot] = target;
+        }
+        std::memcpy(newLoans, loans(), sizeof(StoredLoan) * header()->loanCount);
+        for (uint32_t index = 0; index < header()->loanCount; ++index)
+        {
+            int32_t oldSlot = newLoans[index].userSlot;
+            if (oldSlot >= 0 && static_cast<uint32_t>(oldSlot) < oldCapacity)
+                newLoans[index].userSlot = newSlotOf[oldSlot];
+        }
+
+        // Everything but the magic reaches the disk before the magic does
+        newHeader->version = storeVersion;
+        newHeader->userCapacity = newCapacity;
+        newHeader->loanCapacity = header()->loanCapacity;
+        newHeader->loanCount = header()->loanCount;
+        msync(newBase, newSize, MS_SYNC);
+        std::memcpy(newHeader->magic, "LIBUSERS", 8);
+        msync(newBase, sizeof(Header), MS_SYNC);
+
+        if (rename(growPath.c_str(), path.c_str()) != 0)
+        {
+            std::cerr << "Failed to grow user store: " << std::strerror(errno) << "\n";
+            munmap(newBase, newSize);
+            close(newFd);
+            std::remove(growPath.c_str());
+            return false;
+        }
+        munmap(base, mappedSize);
+        close(fd);
+        fd = newFd;
+        base = newBase;
+        mappedSize = newSize;
+        return true;
+    }
+
+    static int64_t toSeconds(std::chrono::system_clock::time_point time)
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+    }
+
+    static std::chrono::system_clock::time_point fromSeconds(int64_t seconds)
+    {
+        return std::chrono::system_clock::time_point(std::chrono::seconds(seconds));
+    }
+
+    static uint64_t hashName(const std::string &name)
+    {
+        uint64_t hash = 1469598103934665603ULL; // FNV-1a, stable across builds
+        for (unsigned char c : name)
+            hash = (hash ^ c) * 1099511628211ULL;
+        return hash;
+    }
+
+public:
+    UserStore() : fd(-1), base(nullptr), mappedSize(0), userCount(-1) {}
+
+    ~UserStore()
+    {
+        if (base)
+        {
+            msync(base, mappedSize, MS_SYNC);
+            munmap(base, mappedSize);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // Opens or creates the store. The file stays locked while it is open, so a
+    // second process gets an error instead of writing to the same file.
+    bool open(const std::string &filename)
+    {
+        path = filename;
+        fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open user store: " << filename << "\n";
+            return false;
+        }
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            std::cerr << "User store " << filename << " is in use by another process.\n";
+            close(fd);
+            fd = -1;
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            std::cerr << "Failed to read user store: " << std::strerror(errno) << "\n";
+            return false;
+        }
+        if (static_cast<size_t>(info.st_size) < sizeof(Header))
+            return create();
+
+        if (!mapFile(info.st_size))
+            return false;
+        if (std::memcmp(header()->magic, "LIBUSERS", 8) != 0)
+        {
+            // Creation was interrupted before the header was complete
+            std::cerr << "User store " << filename << " was not fully created, starting a new one.\n";
+            munmap(base, mappedSize);
+            base = nullptr;
+            return create();
+        }
+        if (header()->version == 1 && !migrateFromVersion1(filename))
+        {
+            if (base)
+            {
+                munmap(base, mappedSize);
+                base = nullptr;
+            }
+            return false;
+        }
+        if (header()->version != storeVersion || fileSize(header()->userCapacity, header()->loanCapacity) > mappedSize)
+        {
+            std::cerr << "User store " << filename << " is not valid, moving it to " << filename << ".invalid and starting a new one.\n";
+            munmap(base, mappedSize);
+            base = nullptr;
+            if (rename(filename.c_str(), (filename + ".invalid").c_str()) != 0)
+            {
+                std::cerr << "Failed to move user store: " << std::strerror(errno) << "\n";
+                return false;
+            }
+            close(fd);
+            fd = -1;
+            return open(filename);
+        }
+        return true;
+    }
+
+    bool isOpen() const
+    {
+        return base != nullptr;
+    }
+
+    // Returns false if the user is not stored yet.
+    bool findUser(const std::string &username, bool &isStudent) const
+    {
+        long slot = findSlot(username, false);
+        if (slot < 0)
+            return false;
+        isStudent = users()[slot].isStudent != 0;
+        return true;
+    }
+
+    bool saveUser(const std::string &username, bool isStudent)
+    {
+        if (username.size() >= sizeof(StoredUser().username))
+        {
+            std::cerr << "Username is too long to store.\n";
+            return false;
+        }
+
+        // A new user may not fill more than 3/4 of the slots, so probe runs stay short
+        long slot = findSlot(username, true);
+        if (slot >= 0 && !users()[slot].inUse)
+        {
+            if (userCount < 0)
+                userCount = countUsers();
+            if ((userCount + 1) * 4 > static_cast<long>(header()->userCapacity) * 3)
+                slot = growUsers() ? findSlot(username, true) : -1;
+        }
+        if (slot < 0)
+        {
+            std::cerr << "User store is full.\n";
+            return false;
+        }
+
+        StoredUser &user = users()[slot];
+        if (!user.inUse)
+        {
+            ++userCount;
+            user.nameHash = hashName(username);
+            std::memcpy(user.username, username.c_str(), username.size() + 1);
+            user.firstLoan = -1;
+        }
+        user.isStudent = isStudent;
+        flush(&user, sizeof(StoredUser));
+        user.inUse = 1;
+        flush(&user, sizeof(StoredUser));
+        return true;
+    }
+
+    // Records a loan, or updates it in place if the user already has the item.
+    bool saveLoan(const std::string &username, const std::string &itemIdentifier, const LoanRecord &record)
+    {
+        long slot = findSlot(username, false);
+        if (slot < 0 || itemIdentifier.size() >= sizeof(StoredLoan().itemIdentifier))
+        {
+            std::cerr << "Loan could not be stored.\n";
+            return false;
+        }
+
+        for (int32_t index = users()[slot].firstLoan; index >= 0; index = loans()[index].nextLoan)
+        {
+            StoredLoan &loan = loans()[index];
+            if (itemIdentifier == loan.itemIdentifier)
+            {
+                loan.borrowedTime = toSeconds(record.borrowedAt);
+                loan.returnTime = toSeconds(record.dueAt);
+                loan.itemType = record.type;
+                loan.renewals = record.renewals;
+                flush(&loan, sizeof(StoredLoan));
+                return true;
+            }
+        }
+
+        if (header()->loanCount == header()->loanCapacity && !growLoans())
+            return false;
+
+        int32_t index = header()->loanCount;
+        StoredLoan &loan = loans()[index];
+        std::memcpy(loan.itemIdentifier, itemIdentifier.c_str(), itemIdentifier.size() + 1);
+        loan.borrowedTime = toSeconds(record.borrowedAt);
+        loan.returnTime = toSeconds(record.dueAt);
+        loan.itemType = record.type;
+        loan.renewals = record.renewals;
+        loan.nextLoan = users()[slot].firstLoan;
+        loan.userSlot = slot;
+        flush(&loan, sizeof(StoredLoan));
+        header()->loanCount = index + 1;
+        flush(header(), sizeof(Header));
+        users()[slot].firstLoan = index;
+        flush(&users()[slot], sizeof(StoredUser));
+        return true;
+    }
+
+    void loadLoans(const std::string &username, std::map<std::string, LoanRecord> &borrowedItems) const
+    {
+        long slot = findSlot(username, false);
+        if (slot < 0)
+            return;
+
+        for (int32_t index = users()[slot].firstLoan; index >= 0; index = loans()[index].nextLoan)
+        {
+            const StoredLoan &loan = loans()[index];
+            LoanRecord &record = borrowedItems[loan.itemIdentifier];
+            record.borrowedAt = fromSeconds(loan.borrowedTime);
+            record.dueAt = fromSeconds(loan.returnTime);
+            record.type = static_cast<ItemType>(loan.itemType);
+            record.renewals = loan.renewals;
+        }
+    }
+};
+
 class User
 {
 private:
     std::string username;
-    std::map<std::string, std::chrono::system_clock::time_point> borrowedItems;
+    std::map<std::string, LoanRecord> borrowedItems;
     bool isStudent;  // Added to store user type
+    UserStore *store;
+    const LoanPolicyTable *policies;
+    int heldCount[ItemTypeCount]; // Items held per type, so limit checks do not scan the loans
 
 public:
-    User(const std::string &name) : username(name), isStudent(true) {}  // Default to student
+    User(const std::string &name) : username(name), isStudent(true), store(nullptr), policies(&defaultLoanPolicies()), heldCount() {}  // Default to student
+
+    void setLoanPolicies(const LoanPolicyTable *loanPolicies)
+    {
+        policies = loanPolicies;
+    }
+
+    const LoanPolicy &loanPolicy(ItemType type) const
+    {
+        return policies->lookup(isStudent ? StudentUser : FacultyUser, type);
+    }
 
     void setUserType(bool student) {
         isStudent = student;
+        if (store)
+            store->saveUser(username, isStudent);
     }
 
-    void borrowItem(const std::string &itemIdentifier)
+    // Loads this user's saved loans; later borrows are written through to the store.
+    void setStore(UserStore *userStore)
     {
-        auto currentTime = std::chrono::system_clock::now();
+        store = userStore;
+        store->loadLoans(username, borrowedItems);
+        std::fill(heldCount, heldCount + ItemTypeCount, 0);
+        for (const auto &borrowedItem : borrowedItems)
+        {
+            if (borrowedItem.second.type < ItemTypeCount)
+                ++heldCount[borrowedItem.second.type];
+        }
+    }
 
-        // Calculate the return duration based on the user type
-        std::chrono::duration<int> returnDuration;
-        if (isStudent)
-            returnDuration = std::chrono::hours(24 * 30);  // Student: 30 days
-        else
-            returnDuration = std::chrono::hours(24 * 30 * 6);  // Faculty: 6 months
+    // Returns false if the user already holds as many items of this type as the policy allows.
+    // Borrowing an item the user already holds renews it, within the renewal limit.
+    bool borrowItem(const std::string &itemIdentifier, ItemType type)
+    {
+        if (hasBorrowed(itemIdentifier))
+            return renewItem(itemIdentifier);
+        if (heldCount[type] >= loanPolicy(type).maxItems)
+            return false;
+        ++heldCount[type];
+
+        // The due date is fixed here from the loan policy and only stored from now on
+        LoanRecord &loan = borrowedItems[itemIdentifier];
+        loan.borrowedAt = std::chrono::system_clock::now();
+        loan.dueAt = loan.borrowedAt + loanPolicy(type).loanPeriod;
+        loan.type = type;
+        loan.renewals = 0;
+
+        if (store)
+            store->saveLoan(username, itemIdentifier, loan);
+        return true;
+    }
 
-        auto returnTime = currentTime + returnDuration;
+    bool hasBorrowed(const std::string &itemIdentifier) const
+    {
+        return borrowedItems.count(itemIdentifier) > 0;
+    }
 
-        borrowedItems[itemIdentifier] = returnTime;
+    // Extends the due date by another loan period, if the policy allows more renewals.
+    bool renewItem(const std::string &itemIdentifier)
+    {
+        auto it = borrowedItems.find(itemIdentifier);
+        if (it == borrowedItems.end() || it->second.renewals >= loanPolicy(it->second.type).maxRenewals)
+            return false;
+
+        it->second.dueAt += loanPolicy(it->second.type).loanPeriod;
+        ++it->second.renewals;
+
+        if (store)
+            store->saveLoan(username, itemIdentifier, it->second);
+        return true;
     }
 
-  std::string formatTime(const std::chrono::system_clock::time_point& timePoint) {
+  // Uses localtime_r: std::localtime and std::ctime share one buffer, and replay
+  // sessions format times on several threads at once.
+  static std::string formatTime(const std::chrono::system_clock::time_point& timePoint, const char *format = "%Y-%m-%d %H:%M:%S") {
     std::time_t time = std::chrono::system_clock::to_time_t(timePoint);
+    std::tm local;
+    localtime_r(&time, &local);
     std::ostringstream oss;
-    oss << std::put_time(std::localtime(&time), "%Y-%m-%d %H:%M:%S");
+    oss << std::put_time(&local, format);
     return oss.str();
 }
 
-void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Magazine> &magazines, const std::vector<Journal> &journals) const
+// With a catalog filter, items that are certainly not in the catalog skip the scans.
+void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Magazine> &magazines, const std::vector<Journal> &journals,
+                          std::ostream &out = std::cout, const BloomFilter *catalogFilter = nullptr) const
 {
-    std::cout << "Borrowed Items for User " << username << ":\n";
+    out << "Borrowed Items for User " << username << ":\n";
 
     if (borrowedItems.empty()) {
-        std::cout << "No items currently borrowed.\n";
+        out << "No items currently borrowed.\n";
         return;
     }
 
     for (const auto &borrowedItem : borrowedItems)
     {
         const std::string &itemIdentifier = borrowedItem.first;
-        auto borrowedDate = std::chrono::system_clock::to_time_t(borrowedItem.second);
-
-        std::chrono::system_clock::time_point returnTime = borrowedItem.second;
-        if (isStudent)
-            returnTime += std::chrono::hours(24 * 30 * 1);  // Adjusted return duration for students
-        else
-            returnTime += std::chrono::hours(24 * 30 * 6);  // Adjusted return duration for faculty
+        std::string borrowedDate = formatTime(borrowedItem.second.borrowedAt, "%a %b %e %H:%M:%S %Y"); // Same layout as std::ctime
+        std::string returnDate = formatTime(borrowedItem.second.dueAt, "%a %b %e %H:%M:%S %Y");
 
-        auto returnDate = std::chrono::system_clock::to_time_t(returnTime);
+        if (catalogFilter && !catalogFilter->mightContain(itemIdentifier))
+        {
+            out << "Item not found.\n";
+            continue;
+        }
 
         bool found = false;
 
@@ -202,10 +1053,10 @@ void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Maga
         {
             if (book.getIdentifier() == itemIdentifier)
             {
-                std::cout << "Borrowed from Books:\n";
-                book.displayInfo();
-                std::cout << "Borrowed Date: " << std::ctime(&borrowedDate);
-                std::cout << "Return Date: " << std::ctime(&returnDate);
+                out << "Borrowed from Books:\n";
+                book.displayInfo(out);
+                out << "Borrowed Date: " << borrowedDate << "\n";
+                out << "Return Date: " << returnDate << "\n";
                 found = true;
                 break;
             }
@@ -216,10 +1067,10 @@ void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Maga
         {
             if (magazine.getIdentifier() == itemIdentifier)
             {
-                std::cout << "Borrowed from Magazines:\n";
-                magazine.displayInfo();
-                std::cout << "Borrowed Date: " << std::ctime(&borrowedDate);
-                std::cout << "Return Date: " << std::ctime(&returnDate);
+                out << "Borrowed from Magazines:\n";
+                magazine.displayInfo(out);
+                out << "Borrowed Date: " << borrowedDate << "\n";
+                out << "Return Date: " << returnDate << "\n";
                 found = true;
                 break;
             }
@@ -230,17 +1081,17 @@ void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Maga
         {
             if (journal.getIdentifier() == itemIdentifier)
             {
-                std::cout << "Borrowed from Journals:\n";
-                journal.displayInfo();
-                std::cout << "Borrowed Date: " << std::ctime(&borrowedDate);
-                std::cout << "Return Date: " << std::ctime(&returnDate);
+                out << "Borrowed from Journals:\n";
+                journal.displayInfo(out);
+                out << "Borrowed Date: " << borrowedDate << "\n";
+                out << "Return Date: " << returnDate << "\n";
                 found = true;
                 break;
             }
         }
 
         if (!found)
-            std::cout << "Item not found.\n";
+            out << "Item not found.\n";
     }
 }
 
@@ -359,108 +1210,512 @@ void readJournalsCSV(const std::string &filename, std::vector<Journal> &journals
     file.close();
 }
 
+std::vector<std::string> splitFields(const std::string &line, char separator = '\t')
+{
+    std::vector<std::string> fields;
+    std::string field;
+    std::istringstream iss(line);
+    while (std::getline(iss, field, separator))
+        fields.push_back(field);
+    if (!line.empty() && line.back() == separator)
+        fields.push_back("");
+    return fields;
+}
+
+// One menu operation: the menu choice ("*" for input read before the menu)
+// and every field typed for it, with its offset from the start of the session.
+struct TraceOperation
+{
+    long long offsetMicros;
+    std::string choice;
+    std::vector<std::string> fields;
+};
+
+// Wraps the menu's input stream. While recording, every operation is written
+// to a trace file as "offset<TAB>choice<TAB>field...". While replaying, it
+// times each operation and can pace them to their recorded offsets.
+class MenuInput
+{
+private:
+    std::istream &in;
+    std::chrono::steady_clock::time_point sessionStart;
+    TraceOperation current;
+
+    std::ofstream trace;
+    bool recording;
+
+    const std::vector<TraceOperation> *replayOperations;
+    bool paced;
+    size_t nextOperation;
+    std::chrono::steady_clock::time_point operationStart;
+    std::vector<long long> latencies;
+
+    long long elapsedMicros() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sessionStart).count();
+    }
+
+    void endOperation()
+    {
+        if (recording)
+        {
+            trace << current.offsetMicros << '\t' << current.choice;
+            for (const auto &field : current.fields)
+                trace << '\t' << field;
+            trace << '\n';
+        }
+
+        if (replayOperations && nextOperation > 0)
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - operationStart).count());
+    }
+
+    void beginOperation(const std::string &choice)
+    {
+        if (replayOperations && nextOperation < replayOperations->size())
+        {
+            if (paced)
+                std::this_thread::sleep_until(sessionStart + std::chrono::microseconds((*replayOperations)[nextOperation].offsetMicros));
+            ++nextOperation;
+        }
+
+        current.offsetMicros = elapsedMicros();
+        current.choice = choice;
+        current.fields.clear();
+        operationStart = std::chrono::steady_clock::now();
+    }
+
+public:
+    MenuInput(std::istream &input)
+        : in(input), sessionStart(std::chrono::steady_clock::now()), recording(false), replayOperations(nullptr), paced(false), nextOperation(0)
+    {
+        beginOperation("*");
+    }
+
+    // Replays operations read from input; the stream must hold their text.
+    MenuInput(std::istream &input, const std::vector<TraceOperation> &operations, bool pacedReplay)
+        : in(input), sessionStart(std::chrono::steady_clock::now()), recording(false), replayOperations(&operations), paced(pacedReplay), nextOperation(0)
+    {
+        beginOperation("*");
+    }
+
+    bool startRecording(const std::string &filename)
+    {
+        trace.open(filename);
+        if (!trace.is_open())
+        {
+            std::cerr << "Failed to open trace file: " << filename << "\n";
+            return false;
+        }
+        recording = true;
+        return true;
+    }
+
+    // Reads the next menu choice. At end of input it returns exitChoice, and
+    // anything that is not a number gives 0. The text is recorded as typed.
+    int readChoice(int exitChoice)
+    {
+        endOperation();
+
+        std::string token;
+        if (!(in >> token))
+        {
+            beginOperation(std::to_string(exitChoice));
+            return exitChoice;
+        }
+
+        char *end = nullptr;
+        long value = std::strtol(token.c_str(), &end, 10);
+        int choice = *end == '\0' && value > 0 && value <= INT_MAX ? static_cast<int>(value) : 0;
+        beginOperation(token);
+        return choice;
+    }
+
+    // Records the end of the last operation and flushes the trace.
+    void finish()
+    {
+        endOperation();
+        replayOperations = nullptr;
+        if (recording)
+            trace.flush();
+    }
+
+    MenuInput &operator>>(std::string &value)
+    {
+        in >> value;
+        current.fields.push_back(value);
+        return *this;
+    }
+
+    MenuInput &operator>>(int &value)
+    {
+        in >> value;
+        current.fields.push_back(std::to_string(value));
+        return *this;
+    }
+
+    // Adds a value to the current operation as if it had been typed.
+    void recordField(const std::string &value)
+    {
+        current.fields.push_back(value);
+    }
+
+    void getline(std::string &value)
+    {
+        std::getline(in, value);
+        current.fields.push_back(value);
+    }
+
+    void ignore(std::streamsize count = 1, int delimiter = EOF)
+    {
+        in.ignore(count, delimiter);
+    }
+
+    void clear()
+    {
+        in.clear();
+    }
+
+    const std::vector<long long> &getLatencies() const
+    {
+        return latencies;
+    }
+};
+
+// Output sink for replay sessions.
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override
+    {
+        return c;
+    }
+};
+
+std::vector<TraceOperation> readTrace(const std::string &filename)
+{
+    std::vector<TraceOperation> operations;
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return operations;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNum;
+        std::vector<std::string> fields = splitFields(line);
+        if (fields.size() < 2)
+        {
+            std::cerr << "Invalid line format at line " << lineNum << "\n";
+            continue;
+        }
+
+        TraceOperation operation;
+        operation.offsetMicros = std::atoll(fields[0].c_str());
+        operation.choice = fields[1];
+        operation.fields.assign(fields.begin() + 2, fields.end());
+        operations.push_back(operation);
+    }
+
+    file.close();
+    return operations;
+}
+
+// Turns operations back into the text a user would have typed.
+std::string traceInput(const std::vector<TraceOperation> &operations)
+{
+    std::string input;
+    for (const auto &operation : operations)
+    {
+        if (operation.choice != "*")
+            input += operation.choice + "\n";
+        for (const auto &field : operation.fields)
+            input += field + "\n";
+    }
+    return input;
+}
+
+void reportReplay(size_t sessions, std::vector<long long> &latencies, std::chrono::steady_clock::duration wallTime)
+{
+    std::sort(latencies.begin(), latencies.end());
+    double seconds = std::chrono::duration<double>(wallTime).count();
+
+    std::cout << "Replayed " << latencies.size() << " operations in " << sessions << " sessions in " << seconds << " s ("
+              << (seconds > 0 ? latencies.size() / seconds : 0) << " operations per second)\n";
+    if (latencies.empty())
+        return;
+
+    const double percentiles[] = {50, 90, 99, 99.9};
+    for (double p : percentiles)
+    {
+        size_t rank = std::min(latencies.size() - 1, static_cast<size_t>(p / 100 * latencies.size()));
+        std::cout << "  p" << p << ": " << latencies[rank] / 1000.0 << " us\n";
+    }
+    std::cout << "  max: " << latencies.back() / 1000.0 << " us\n";
+}
+
+// Builds the filter over every catalog identifier, sized with room to grow.
+BloomFilter buildCatalogFilter(const std::vector<Book> &books, const std::vector<Magazine> &magazines, const std::vector<Journal> &journals)
+{
+    BloomFilter filter(2 * (books.size() + magazines.size() + journals.size()));
+    for (const auto &book : books)
+        filter.add(book.getIdentifier());
+    for (const auto &magazine : magazines)
+        filter.add(magazine.getIdentifier());
+    for (const auto &journal : journals)
+        filter.add(journal.getIdentifier());
+    return filter;
+}
+
+// Finds which catalog list holds the item. Returns false if it is in none of them.
+bool findItemType(const std::string &itemIdentifier, const std::vector<Book> &books, const std::vector<Magazine> &magazines,
+                  const std::vector<Journal> &journals, const BloomFilter &catalogFilter, ItemType &type)
+{
+    if (!catalogFilter.mightContain(itemIdentifier))
+        return false;
+
+    for (const auto &book : books)
+    {
+        if (book.getIdentifier() == itemIdentifier)
+        {
+            type = BookItem;
+            return true;
+        }
+    }
+    for (const auto &magazine : magazines)
+    {
+        if (magazine.getIdentifier() == itemIdentifier)
+        {
+            type = MagazineItem;
+            return true;
+        }
+    }
+    for (const auto &journal : journals)
+    {
+        if (journal.getIdentifier() == itemIdentifier)
+        {
+            type = JournalItem;
+            return true;
+        }
+    }
+    return false;
+}
+
 class BookStore
 {
 public:
-    void purchaseNewBook(std::vector<Book> &books)
+    void purchaseNewBook(MenuInput &in, std::ostream &out, std::vector<Book> &books)
     {
         std::string isbn, authors, title, location, returnDuration;
         int count;
 
-        std::cout << "Enter ISBN: ";
-        std::cin >> isbn;
+        out << "Enter ISBN: ";
+        in >> isbn;
 
-        std::cout << "Enter authors: ";
-        std::cin.ignore();
-        std::getline(std::cin, authors);
+        out << "Enter authors: ";
+        in.ignore();
+        in.getline(authors);
 
-        std::cout << "Enter title: ";
-        std::getline(std::cin, title);
+        out << "Enter title: ";
+        in.getline(title);
 
-        std::cout << "Enter location: ";
-        std::getline(std::cin, location);
+        out << "Enter location: ";
+        in.getline(location);
 
-        std::cout << "Enter return duration: ";
-        std::getline(std::cin, returnDuration);
+        out << "Enter return duration: ";
+        in.getline(returnDuration);
 
-        std::cout << "Enter count: ";
-        std::cin >> count;
+        out << "Enter count: ";
+        in >> count;
 
         Book newBook(isbn, location, returnDuration, count, isbn, authors, title);
         books.push_back(newBook);
 
-        std::cout << "Book purchased and added to the library.\n";
+        out << "Book purchased and added to the library.\n";
     }
 };
 
-int main()
+// Runs one library session: logs the user in, then reads menu choices until they exit.
+// Without a store, users and loans are not saved.
+void runMenu(MenuInput &in, std::ostream &out, std::vector<Book> books, std::vector<Magazine> magazines, std::vector<Journal> journals,
+             const LoanPolicyTable &loanPolicies, UserStore *store)
 {
-    std::vector<Book> books;
-    readBooksCSV("books.csv", books);
-
-    std::vector<Magazine> magazines;
-    readMagazinesCSV("magazines.csv", magazines);
-
-    std::vector<Journal> journals;
-    readJournalsCSV("journals.csv", journals);
-
     std::string username;
-    std::cout << "Enter username: ";
-    std::cin.ignore();
-    std::getline(std::cin, username);
-
-    int userType;  // 1 for student, 2 for faculty
-    std::cout << "Enter user type (1 for student, 2 for faculty): ";
-    std::cin >> userType;
+    out << "Enter username: ";
+    in.getline(username);
+
+    // Returning users keep the type they registered with
+    bool isStudent;
+    if (store && store->findUser(username, isStudent))
+        in.recordField(isStudent ? "1" : "2"); // So a replay without the store reads the same type
+    else
+    {
+        int userType;  // 1 for student, 2 for faculty
+        out << "Enter user type (1 for student, 2 for faculty): ";
+        in >> userType;
 
-    bool isStudent = (userType == 1);
+        isStudent = (userType == 1);
+    }
 
     User user(username);
+    user.setLoanPolicies(&loanPolicies);
+    if (store)
+        user.setStore(store);
+    user.setUserType(isStudent);
 
     BookStore bookStore;
+    BloomFilter catalogFilter = buildCatalogFilter(books, magazines, journals);
 
     int choice;
     do
     {
-        std::cout << "Menu:\n";
-        std::cout << "1. Borrow an item\n";
-        std::cout << "2. Display borrowed items\n";
-        std::cout << "3. Register a new user\n";
-        std::cout << "4. Purchase a new book\n";
-        std::cout << "5. Exit\n";
-        std::cout << "Enter your choice: ";
-        std::cin >> choice;
+        out << "Menu:\n";
+        out << "1. Borrow an item\n";
+        out << "2. Display borrowed items\n";
+        out << "3. Register a new user\n";
+        out << "4. Purchase a new book\n";
+        out << "5. Renew a borrowed item\n";
+        out << "6. Exit\n";
+        out << "Enter your choice: ";
+        choice = in.readChoice(6);
 
         switch (choice)
         {
         case 1:
 {
     std::string itemIdentifier;
-    std::cin.ignore();
-    std::cout << "Enter the item identifier to borrow: ";
-    std::getline(std::cin, itemIdentifier);
-
-    // Call borrowItem with the correct parameters
-    user.borrowItem(itemIdentifier);  // Pass only the item identifier, not isStudent
-    std::cout << "Successfully borrowed the item.\n";
+    in.ignore();
+    out << "Enter the item identifier to borrow: ";
+    in.getline(itemIdentifier);
+
+    ItemType type;
+    bool renewal = user.hasBorrowed(itemIdentifier);
+    if (!findItemType(itemIdentifier, books, magazines, journals, catalogFilter, type))
+        out << "Item not found.\n";
+    else if (user.borrowItem(itemIdentifier, type))
+        out << (renewal ? "Item renewed.\n" : "Successfully borrowed the item.\n");
+    else
+        out << (renewal ? "Item cannot be renewed.\n" : "Loan limit reached for this item type.\n");
     break;
 }
        case 2:
-    user.displayBorrowedItems(books, magazines, journals);
+    user.displayBorrowedItems(books, magazines, journals, out, &catalogFilter);
     break;
 
         case 3:
-            std::cout << "User registered successfully.\n";
+            out << "User registered successfully.\n";
             break;
         case 4:
-            bookStore.purchaseNewBook(books);
+            bookStore.purchaseNewBook(in, out, books);
+            catalogFilter.add(books.back().getIdentifier());
+            if (catalogFilter.isSaturated())
+                catalogFilter = buildCatalogFilter(books, magazines, journals);
+            break;
+        case 5:
+        {
+            std::string itemIdentifier;
+            in.ignore();
+            out << "Enter the item identifier to renew: ";
+            in.getline(itemIdentifier);
+
+            if (user.renewItem(itemIdentifier))
+                out << "Item renewed.\n";
+            else
+                out << "Item cannot be renewed.\n";
+            break;
+        }
+        case 6:
+            out << "Exiting the program. Goodbye!\n";
             break;
         default:
-            std::cout << "Invalid choice. Try again.\n";
-            std::cin.clear();
-            std::cin.ignore(INT_MAX, '\n');
+            out << "Invalid choice. Try again.\n";
+            in.clear();
+            in.ignore(INT_MAX, '\n');
+        }
+    } while (choice != 6);
+
+    in.finish();
+}
+
+// Replays a recorded trace on several independent sessions at once.
+void replayTrace(const std::string &filename, int threadCount, bool paced,
+                 const std::vector<Book> &books, const std::vector<Magazine> &magazines, const std::vector<Journal> &journals,
+                 const LoanPolicyTable &loanPolicies)
+{
+    std::vector<TraceOperation> operations = readTrace(filename);
+    std::string input = traceInput(operations);
+    std::vector<std::vector<long long>> latencies(threadCount);
+
+    auto session = [&](int index) {
+        // Copied before the session clock starts, so the copy is not in the first latency
+        std::vector<Book> sessionBooks = books;
+        std::vector<Magazine> sessionMagazines = magazines;
+        std::vector<Journal> sessionJournals = journals;
+
+        std::istringstream stream(input);
+        MenuInput in(stream, operations, paced);
+        NullBuffer nullBuffer;
+        std::ostream out(&nullBuffer);
+        runMenu(in, out, std::move(sessionBooks), std::move(sessionMagazines), std::move(sessionJournals), loanPolicies, nullptr);
+        latencies[index] = in.getLatencies();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i)
+        threads.push_back(std::thread(session, i));
+    for (auto &thread : threads)
+        thread.join();
+    auto wallTime = std::chrono::steady_clock::now() - start;
+
+    std::vector<long long> allLatencies;
+    for (const auto &sessionLatencies : latencies)
+        allLatencies.insert(allLatencies.end(), sessionLatencies.begin(), sessionLatencies.end());
+    reportReplay(threadCount, allLatencies, wallTime);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<Book> books;
+    readBooksCSV("books.csv", books);
+
+    std::vector<Magazine> magazines;
+    readMagazinesCSV("magazines.csv", magazines);
+
+    std::vector<Journal> journals;
+    readJournalsCSV("journals.csv", journals);
+
+    LoanPolicyTable loanPolicies;
+    loanPolicies.load("loan_policies.csv");
+
+    // "--replay FILE [THREADS] [--paced]" replays a trace and reports latencies
+    if (argc >= 3 && std::string(argv[1]) == "--replay")
+    {
+        int threadCount = 1;
+        bool paced = false;
+        for (int i = 3; i < argc; ++i)
+        {
+            if (std::string(argv[i]) == "--paced")
+                paced = true;
+            else
+                threadCount = std::max(1, std::atoi(argv[i]));
         }
-    } while (choice != 5);
+        replayTrace(argv[2], threadCount, paced, books, magazines, journals, loanPolicies);
+        return 0;
+    }
+
+    // "--record FILE" writes every menu operation to a trace file
+    MenuInput input(std::cin);
+    if (argc == 3 && std::string(argv[1]) == "--record" && !input.startRecording(argv[2]))
+        return 1;
+
+    UserStore userStore;
+    userStore.open("users.db");
+
+    runMenu(input, std::cout, std::move(books), std::move(magazines), std::move(journals), loanPolicies, userStore.isOpen() ? &userStore : nullptr);
 
     return 0;
 }
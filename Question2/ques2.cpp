@@ -6,519 +6,4258 @@
 #include <map>
 #include <chrono>
 #include <climits>
+#include <deque>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+#include <list>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <set>
+#include <streambuf>
+#include <new>
+#include <random>
+#include <exception>
 
-
-
-class LibraryItem
-{             
-protected:
-    std::string identifier;
-
-
-    
-
-public:
-    LibraryItem(const std::string &id) : identifier(id) {}
-    virtual void displayInfo() const = 0;
-    virtual std::string getIdentifier() const
-    {
-        return identifier;
-    }
+// Parts of the program whose memory is tracked by TrackingAllocator.
+enum MemorySubsystem
+{
+    CatalogRecords, // Item vectors and the lazy record cache
+    CatalogStrings, // Identifiers, names and other text fields of items
+    CatalogIndexes, // CatalogIndex lookup tables, ordered indexes and identifier filter
+    LoanMaps,       // Borrowed items of every user
+    LoanStock,      // LoanExecutor stock counters and their lookup table
+    ReportTables,   // ReportSnapshots versions, rows and row lookups
+    LoanStatistics, // LoanAnalytics sketches, counters and rate windows
+    MemorySubsystemCount
 };
 
-class PhysicalItem : public LibraryItem
+const char *memorySubsystemName(MemorySubsystem subsystem)
 {
-protected:
-    std::string location;
-    std::string returnDuration;
+    static const char *names[] = {"Catalog records", "Catalog strings", "Catalog indexes", "Loan maps", "Loan stock", "Report snapshots",
+                                  "Loan statistics"};
+    return names[subsystem];
+}
+
+// Thrown when an allocation would take the tracked total past the memory budget.
+class MemoryBudgetExceeded : public std::bad_alloc
+{
+private:
+    std::string message;
 
 public:
-    PhysicalItem(const std::string &id, const std::string &loc, const std::string &duration)
-        : LibraryItem(id), location(loc), returnDuration(duration) {}
-    virtual void displayInfo() const override
+    MemoryBudgetExceeded(MemorySubsystem subsystem, size_t bytes, long long used, long long budget)
+        : message("Memory budget exceeded: " + std::string(memorySubsystemName(subsystem)) + " asked for " + std::to_string(bytes) +
+                  " bytes with " + std::to_string(used) + " of " + std::to_string(budget) + " bytes in use")
     {
-        std::cout << "Identifier: " << identifier << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
     }
 
-    std::string getIdentifier() const override
+    const char *what() const noexcept override
     {
-        return identifier;
+        return message.c_str();
     }
 };
 
-class LoanableItem : public PhysicalItem
+// Live bytes, allocation counts and peaks per subsystem, plus an optional
+// budget on the tracked total. Counters are atomic because batch and replay
+// threads allocate concurrently.
+class MemoryAccounting
 {
 private:
-    bool isOnLoan;
-    std::chrono::system_clock::time_point returnDate;
+    struct Usage
+    {
+        std::atomic<long long> bytes;
+        std::atomic<long long> peakBytes;
+        std::atomic<long long> liveAllocations;
+        std::atomic<long long> totalAllocations;
+    };
 
-public:
-    LoanableItem(const std::string &id, const std::string &loc, const std::string &duration)
-        : PhysicalItem(id, loc, duration), isOnLoan(false) {}
+    Usage usage[MemorySubsystemCount];
+    std::atomic<long long> totalBytes;
+    std::atomic<long long> peakTotalBytes;
+    std::atomic<long long> budget; // 0 means no budget
 
-    bool canBeBorrowed() const
+    static void raisePeak(std::atomic<long long> &peak, long long value)
     {
-        return !isOnLoan;
+        long long current = peak.load();
+        while (current < value && !peak.compare_exchange_weak(current, value))
+        {
+        }
     }
 
-    void borrow()
+public:
+    MemoryAccounting() : totalBytes(0), peakTotalBytes(0), budget(0)
     {
-        isOnLoan = true;
-        returnDate = std::chrono::system_clock::now() + std::chrono::hours(168); // 7 days later
+        for (auto &entry : usage)
+        {
+            entry.bytes = 0;
+            entry.peakBytes = 0;
+            entry.liveAllocations = 0;
+            entry.totalAllocations = 0;
+        }
     }
 
-    void returnItem()
+    void setBudget(long long bytes)
     {
-        isOnLoan = false;
+        budget = bytes;
     }
 
-    bool isOnLoanStatus() const
+    // Counts an allocation, or throws MemoryBudgetExceeded before anything is allocated.
+    void allocated(MemorySubsystem subsystem, size_t bytes)
     {
-        return isOnLoan;
+        long long total = totalBytes.fetch_add(bytes) + bytes;
+        long long limit = budget.load();
+        if (limit > 0 && total > limit)
+        {
+            totalBytes.fetch_sub(bytes);
+            throw MemoryBudgetExceeded(subsystem, bytes, total - bytes, limit);
+        }
+        raisePeak(peakTotalBytes, total);
+
+        Usage &entry = usage[subsystem];
+        raisePeak(entry.peakBytes, entry.bytes.fetch_add(bytes) + bytes);
+        ++entry.liveAllocations;
+        ++entry.totalAllocations;
     }
 
-    std::chrono::system_clock::time_point getReturnDate() const
+    void released(MemorySubsystem subsystem, size_t bytes)
     {
-        return returnDate;
+        totalBytes.fetch_sub(bytes);
+        usage[subsystem].bytes.fetch_sub(bytes);
+        --usage[subsystem].liveAllocations;
     }
 
-    virtual void displayInfo() const override
+    void displayReport(std::ostream &out = std::cout) const
     {
-        PhysicalItem::displayInfo();
-        std::cout << "Item is " << (isOnLoan ? "on loan until " : "available for borrowing") << std::chrono::system_clock::to_time_t(returnDate) << "\n";
+        out << "Memory usage (live bytes, live allocations, total allocations, peak bytes):\n";
+        for (int i = 0; i < MemorySubsystemCount; ++i)
+        {
+            const Usage &entry = usage[i];
+            out << "  " << memorySubsystemName(static_cast<MemorySubsystem>(i)) << ": " << entry.bytes << " bytes, " << entry.liveAllocations
+                << " live, " << entry.totalAllocations << " total, peak " << entry.peakBytes << " bytes\n";
+        }
+        out << "  All tracked: " << totalBytes << " bytes, peak " << peakTotalBytes << " bytes\n";
+        if (budget > 0)
+            out << "  Budget: " << budget << " bytes\n";
+        else
+            out << "  Budget: none\n";
     }
 };
 
-class ElectronicItem : public LibraryItem
+MemoryAccounting &memoryAccounting()
 {
-protected:
-    std::string accessLink;
+    static MemoryAccounting accounting;
+    return accounting;
+}
 
-public:
-    ElectronicItem(const std::string &id, const std::string &link)
-        : LibraryItem(id), accessLink(link) {}
-    virtual void displayInfo() const override
+// Standard allocator that charges every allocation to one subsystem.
+template <typename T, MemorySubsystem Subsystem>
+struct TrackingAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef TrackingAllocator<U, Subsystem> other;
+    };
+
+    TrackingAllocator() {}
+
+    template <typename U>
+    TrackingAllocator(const TrackingAllocator<U, Subsystem> &) {}
+
+    T *allocate(size_t n)
     {
-        std::cout << "Identifier: " << identifier << ", Access Link: " << accessLink << "\n";
+        memoryAccounting().allocated(Subsystem, n * sizeof(T));
+        try
+        {
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        catch (...)
+        {
+            memoryAccounting().released(Subsystem, n * sizeof(T));
+            throw;
+        }
     }
 
-    std::string getIdentifier() const override
+    void deallocate(T *pointer, size_t n)
     {
-        return identifier;
+        memoryAccounting().released(Subsystem, n * sizeof(T));
+        ::operator delete(pointer);
     }
 };
 
-class Book : public PhysicalItem
+template <typename T, typename U, MemorySubsystem Subsystem>
+bool operator==(const TrackingAllocator<T, Subsystem> &, const TrackingAllocator<U, Subsystem> &)
 {
-private:
-    int count;
-    std::string isbn;
-    std::string authors;
-    std::string title;
+    return true;
+}
 
-public:
-    Book(const std::string &id, const std::string &loc, const std::string &duration,
-         int cnt, const std::string &isbnVal, const std::string &auth, const std::string &titleVal)
-        : PhysicalItem(id, loc, duration), count(cnt), isbn(isbnVal), authors(auth), title(titleVal) {}
+template <typename T, typename U, MemorySubsystem Subsystem>
+bool operator!=(const TrackingAllocator<T, Subsystem> &, const TrackingAllocator<U, Subsystem> &)
+{
+    return false;
+}
+
+typedef std::basic_string<char, std::char_traits<char>, TrackingAllocator<char, CatalogStrings>> CatalogString;
+typedef std::basic_string<char, std::char_traits<char>, TrackingAllocator<char, CatalogIndexes>> IndexString;
+typedef std::basic_string<char, std::char_traits<char>, TrackingAllocator<char, ReportTables>> ReportString;
+
+template <typename Allocator>
+std::string plainString(const std::basic_string<char, std::char_traits<char>, Allocator> &value)
+{
+    return std::string(value.data(), value.size());
+}
+
+
+class LibraryItem
+{             
+protected:
+    CatalogString identifier;
+
+
+    
 
-    virtual void displayInfo() const override
+public:
+    LibraryItem(const std::string &id) : identifier(id.begin(), id.end()) {}
+    virtual void displayInfo(std::ostream &out = std::cout) const = 0;
+    virtual std::string getIdentifier() const
     {
-        PhysicalItem::displayInfo();
-        std::cout << "Type: Book, Count: " << count << " ISBN: " << isbn << " Authors: " << authors << " Title: " << title << "\n";
+        return plainString(identifier);
     }
 
-    std::string getIdentifier() const override
+    // Compares without copying the identifier, for lookups over the catalog lists.
+    bool hasIdentifier(const std::string &id) const
     {
-        return identifier;
+        return identifier.size() == id.size() && std::equal(id.begin(), id.end(), identifier.begin());
     }
 };
 
-class Magazine : public PhysicalItem
+// Reads the next comma-separated field. A field in double quotes may contain
+// commas, and "" inside it stands for one quote.
+bool readCsvField(std::istream &in, std::string &field)
 {
-private:
-    std::string publication;
-
-public:
-    Magazine(const std::string &id, const std::string &loc, const std::string &duration, const std::string &pub)
-        : PhysicalItem(id, loc, duration), publication(pub) {}
+    if (in.peek() != '"')
+        return static_cast<bool>(std::getline(in, field, ','));
 
-    virtual void displayInfo() const override
+    field.clear();
+    in.get();
+    char c;
+    while (in.get(c))
     {
-        std::cout << "Identifier: " << getPublication() << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
+        if (c != '"')
+            field += c;
+        else if (in.peek() == '"')
+            field += static_cast<char>(in.get());
+        else
+            break;
     }
+    std::string rest;
+    std::getline(in, rest, ',');
+    return true;
+}
 
-    std::string getPublication() const
-    {
-        return publication;
-    }
+// Splits one "count,isbn,authors,title" line. Returns false if the line has no valid count.
+bool parseBookLine(const std::string &line, int lineNum, int &count, std::string &isbn, std::string &authors, std::string &title)
+{
+    std::istringstream iss(line);
+    std::string token;
 
-    std::string getLocation() const
+    if (std::getline(iss, token, ','))
     {
-        return location;
+        try
+        {
+            count = std::stoi(token);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cerr << "Invalid count at line " << lineNum << ": " << token << "\n";
+            return false;
+        }
     }
-
-    std::string getReturnDuration() const
+    else
     {
-        return returnDuration;
+        std::cerr << "Invalid line format at line " << lineNum << "\n";
+        return false;
     }
-};
 
-class Journal : public PhysicalItem
-{
-private:
-    std::string journalName;
+    readCsvField(iss, isbn);
+    readCsvField(iss, authors);
+    readCsvField(iss, title);
+    return true;
+}
 
-public:
-    Journal(const std::string &id, const std::string &loc, const std::string &duration, const std::string &name)
-        : PhysicalItem(id, loc, duration), journalName(name) {}
+// Reads only the count and ISBN of a books.csv line, the two book fields the
+// lazy catalog keeps in memory. Rejects the same lines parseBookLine does.
+bool parseBookKey(const char *line, size_t length, int lineNum, int &count, std::string &isbn)
+{
+    if (length == 0)
+    {
+        std::cerr << "Invalid line format at line " << lineNum << "\n";
+        return false;
+    }
 
-    virtual void displayInfo() const override
+    const char *end = line + length;
+    const char *countEnd = std::find(line, end, ',');
+    std::string token(line, countEnd);
+    try
     {
-        std::cout << "Identifier: " << journalName << ", Location: " << location << ", Return Duration: " << returnDuration << "\n";
+        count = std::stoi(token);
+    }
+    catch (const std::invalid_argument &e)
+    {
+        std::cerr << "Invalid count at line " << lineNum << ": " << token << "\n";
+        return false;
     }
 
-    std::string getIdentifier() const override
+    isbn.clear();
+    if (countEnd != end)
     {
-        return identifier;
+        isbn.assign(countEnd + 1, std::find(countEnd + 1, end, ','));
+        if (!isbn.empty() && isbn.front() == '"' && isbn.back() == '"')
+            isbn = isbn.substr(1, isbn.length() - 2);
     }
+    return true;
+}
+
+// Fields of a catalog record other than the identifier and count. Lazy items
+// decode them only when first needed; other items share one immutable copy.
+struct CatalogRecord
+{
+    CatalogString location;
+    CatalogString returnDuration;
+    CatalogString isbn;
+    CatalogString authors;
+    CatalogString name; // Book title, magazine publication or journal name
 };
 
-class User
+// A catalog file mapped read-only for the lazy catalog mode. Loading only
+// notes where each record starts; a record is decoded from the mapping the
+// first time one of its fields is needed and kept in a bounded LRU cache, so
+// memory grows with the items actually used rather than with the catalog.
+class CatalogSource
 {
+public:
+    enum class RecordFormat
+    {
+        Book, // "count,isbn,authors,title" lines
+        Name  // One name per line, as in magazines.csv and journals.csv
+    };
+
 private:
-    std::string username;
-    std::map<std::string, std::chrono::system_clock::time_point> borrowedItems;
+    typedef std::pair<size_t, std::shared_ptr<const CatalogRecord>> CachedRecord;
+    typedef std::list<CachedRecord, TrackingAllocator<CachedRecord, CatalogRecords>> RecordList;
+    typedef std::pair<const size_t, RecordList::iterator> CacheEntry;
 
-public:
-    User(const std::string &name) : username(name) {}
+    RecordFormat format;
+    const char *data;
+    size_t size;
+    size_t capacity;
 
-    void borrowItem(const std::string &itemIdentifier, bool isLoanable = false)
+    mutable std::mutex cacheLock;
+    mutable RecordList recent; // Most recently used first
+    mutable std::unordered_map<size_t, RecordList::iterator, std::hash<size_t>, std::equal_to<size_t>, TrackingAllocator<CacheEntry, CatalogRecords>> cached;
+
+    std::shared_ptr<const CatalogRecord> decode(size_t offset) const
     {
-        if (isLoanable)
-        {
+        const char *line = data + offset;
+        const char *end = static_cast<const char *>(memchr(line, '\n', size - offset));
+        std::string text(line, end ? end : data + size);
 
-            borrowedItems[itemIdentifier] = std::chrono::system_clock::now();
-        }
-        else
+        std::shared_ptr<CatalogRecord> record = std::allocate_shared<CatalogRecord>(TrackingAllocator<CatalogRecord, CatalogRecords>());
+        record->location = "Unknown location";
+        record->returnDuration = "Unknown duration";
+        if (format == RecordFormat::Book)
         {
-
-            borrowedItems[itemIdentifier] = std::chrono::system_clock::now();
+            int count;
+            std::string isbn, authors, title;
+            parseBookLine(text, 0, count, isbn, authors, title);
+            record->isbn.assign(isbn.begin(), isbn.end());
+            record->authors.assign(authors.begin(), authors.end());
+            record->name.assign(title.begin(), title.end());
         }
+        else
+            record->name.assign(text.begin(), text.end());
+        return record;
     }
 
-    void displayBorrowedItems(const std::vector<Book> &books, const std::vector<Magazine> &magazines, const std::vector<Journal> &journals) const
-    {
-        std::cout << "Borrowed Items for User " << username << ":\n";
-        for (const auto &borrowedItem : borrowedItems)
-        {
-            const std::string &itemIdentifier = borrowedItem.first;
-
-            std::cout << "Item Identifier: " << itemIdentifier << ", Borrowed Date: " << std::chrono::system_clock::to_time_t(borrowedItem.second) << ", Details:\n";
-
-            bool found = false;
-
-            for (const auto &book : books)
-            {
-                if (book.getIdentifier() == itemIdentifier)
-                {
-                    book.displayInfo();
-                    found = true;
-                    break;
-                }
-            }
-
-            for (const auto &magazine : magazines)
-            {
-                if (magazine.getIdentifier() == itemIdentifier)
-                {
-                    magazine.displayInfo();
-                    found = true;
-                    break;
-                }
-            }
-
-            for (const auto &journal : journals)
-            {
-                if (journal.getIdentifier() == itemIdentifier)
-                {
-                    journal.displayInfo();
-                    found = true;
-                    break;
-                }
-            }
+public:
+    CatalogSource(RecordFormat recordFormat, size_t cacheCapacity = 1024)
+        : format(recordFormat), data(nullptr), size(0), capacity(std::max<size_t>(cacheCapacity, 1)) {}
 
-            if (!found)
-                std::cout << "Item not found.\n";
-        }
-    }
-};
+    CatalogSource(const CatalogSource &) = delete;
+    CatalogSource &operator=(const CatalogSource &) = delete;
 
-void readBooksCSV(const std::string &filename, std::vector<Book> &books)
-{
-    std::ifstream file(filename);
-    if (!file.is_open())
+    ~CatalogSource()
     {
-        std::cerr << "Failed to open file: " << filename << "\n";
-        return;
+        if (data)
+            munmap(const_cast<char *>(data), size);
     }
 
-    std::string line;
-    int lineNum = 0;
-    while (std::getline(file, line))
+    bool open(const std::string &filename)
     {
-        ++lineNum;
-
-        std::istringstream iss(line);
-        std::string token;
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to open file: " << filename << "\n";
+            return false;
+        }
 
-        int count;
-        std::string isbn, authors, title;
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            std::cerr << "Failed to read file size: " << filename << "\n";
+            ::close(fd);
+            return false;
+        }
 
-        if (std::getline(iss, token, ','))
+        if (info.st_size > 0)
         {
-            try
+            void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
             {
-                count = std::stoi(token);
-            }
-            catch (const std::invalid_argument &e)
-            {
-                std::cerr << "Invalid count at line " << lineNum << ": " << token << "\n";
-                continue;
+                std::cerr << "Failed to map file: " << filename << " (" << strerror(errno) << ")\n";
+                ::close(fd);
+                return false;
             }
+            data = static_cast<const char *>(mapping);
+            size = info.st_size;
         }
-        else
+        ::close(fd);
+        return true;
+    }
+
+    // Number of lines, counted without decoding any of them.
+    size_t lineCount() const
+    {
+        size_t lines = 0;
+        for (const char *at = data, *end = data + size; at < end; ++lines)
         {
-            std::cerr << "Invalid line format at line " << lineNum << "\n";
-            continue;
+            const char *newline = static_cast<const char *>(memchr(at, '\n', end - at));
+            at = newline ? newline + 1 : end;
         }
+        return lines;
+    }
 
-        if (std::getline(iss, isbn, ','))
+    // Calls visit(offset, line, length) for every line of the file, in order.
+    template <typename Visit>
+    void forEachLine(Visit visit) const
+    {
+        size_t offset = 0;
+        while (offset < size)
         {
-            if (!isbn.empty() && isbn.front() == '"' && isbn.back() == '"')
-                isbn = isbn.substr(1, isbn.length() - 2);
+            const char *end = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+            size_t length = end ? end - (data + offset) : size - offset;
+            visit(offset, data + offset, length);
+            offset += length + 1;
         }
+    }
 
-        if (std::getline(iss, authors, ','))
+    // Returns the decoded record starting at offset, decoding it on a cache miss.
+    std::shared_ptr<const CatalogRecord> fetch(size_t offset) const
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        auto it = cached.find(offset);
+        if (it != cached.end())
         {
-            if (!authors.empty() && authors.front() == '"' && authors.back() == '"')
-                authors = authors.substr(1, authors.length() - 2);
+            recent.splice(recent.begin(), recent, it->second);
+            return it->second->second;
         }
 
-        if (std::getline(iss, title, ','))
+        recent.emplace_front(offset, decode(offset));
+        cached[offset] = recent.begin();
+        if (recent.size() > capacity)
         {
-            if (!title.empty() && title.front() == '"' && title.back() == '"')
-                title = title.substr(1, title.length() - 2);
+            cached.erase(recent.back().first);
+            recent.pop_back();
         }
-
-        std::string loc = "Unknown location";
-        std::string duration = "Unknown duration";
-        books.emplace_back(isbn, loc, duration, count, isbn, authors, title);
+        return recent.front().second;
     }
 
-    file.close();
-}
+    size_t cachedRecords() const
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        return recent.size();
+    }
+};
 
-void readMagazinesCSV(const std::string &filename, std::vector<Magazine> &magazines)
+// Every field but the identifier lives in a CatalogRecord, so copying an item
+// copies a pointer rather than its strings, and a lazy item is only its
+// identifier, the record's source and its offset.
+class PhysicalItem : public LibraryItem
 {
-    std::ifstream file(filename);
-    if (!file.is_open())
+protected:
+    std::shared_ptr<const CatalogRecord> details; // Null for lazy items
+    const CatalogSource *source;                  // Set for lazy items, whose fields are decoded from it on demand
+    size_t recordOffset;
+
+    std::shared_ptr<const CatalogRecord> record() const
     {
-        std::cerr << "Failed to open file: " << filename << "\n";
-        return;
+        return source ? source->fetch(recordOffset) : details;
     }
 
-    std::string line;
-    while (std::getline(file, line))
+    static std::shared_ptr<const CatalogRecord> makeRecord(const std::string &loc, const std::string &duration,
+                                                           const std::string &isbn, const std::string &authors, const std::string &name)
     {
-        std::string publication = line;
+        std::shared_ptr<CatalogRecord> record = std::allocate_shared<CatalogRecord>(TrackingAllocator<CatalogRecord, CatalogRecords>());
+        record->location.assign(loc.begin(), loc.end());
+        record->returnDuration.assign(duration.begin(), duration.end());
+        record->isbn.assign(isbn.begin(), isbn.end());
+        record->authors.assign(authors.begin(), authors.end());
+        record->name.assign(name.begin(), name.end());
+        return record;
+    }
 
-        std::string loc = "Unknown location";
-        std::string duration = "Unknown duration";
+    PhysicalItem(const std::string &id, std::shared_ptr<const CatalogRecord> record)
+        : LibraryItem(id), details(std::move(record)), source(nullptr), recordOffset(0) {}
 
-        magazines.emplace_back(publication, loc, duration, publication);
-    }
+public:
+    PhysicalItem(const std::string &id, const std::string &loc, const std::string &duration)
+        : PhysicalItem(id, makeRecord(loc, duration, std::string(), std::string(), std::string())) {}
 
-    file.close();
-}
+    // A lazy item: only the identifier is kept, everything else stays in recordSource.
+    PhysicalItem(const std::string &id, const CatalogSource *recordSource, size_t offset)
+        : LibraryItem(id), source(recordSource), recordOffset(offset) {}
 
-void readJournalsCSV(const std::string &filename, std::vector<Journal> &journals)
-{
-    std::ifstream file(filename);
-    if (!file.is_open())
+    virtual void displayInfo(std::ostream &out = std::cout) const override
     {
-        std::cerr << "Failed to open file: " << filename << "\n";
-        return;
+        out << "Identifier: " << identifier << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
     }
 
-    std::string line;
-    while (std::getline(file, line))
+    std::string getLocation() const
     {
-        std::string journalName = line;
+        return plainString(record()->location);
+    }
 
-        std::string loc = "Unknown location";
-        std::string duration = "Unknown duration";
+    std::string getReturnDuration() const
+    {
+        return plainString(record()->returnDuration);
+    }
 
-        journals.emplace_back(journalName, loc, duration, journalName);
+    bool isLazy() const
+    {
+        return source != nullptr;
     }
 
-    file.close();
-}
+    std::string getIdentifier() const override
+    {
+        return plainString(identifier);
+    }
+};
+
+enum UserType
+{
+    StudentUser,
+    FacultyUser,
+    UserTypeCount
+};
+
+enum ItemType
+{
+    BookItem, MagazineItem, JournalItem, LoanableItemType, ItemTypeCount
+};
+
+const char *itemTypeName(ItemType type)
+{
+    static const char *const names[] = {"Book", "Magazine", "Journal", "Loanable"};
+    return names[type];
+}
+
+struct LoanPolicy
+{
+    std::chrono::hours loanPeriod;
+    int maxItems; // Items of this type a user may hold at once
+    int maxRenewals;
+};
+
+// Loan rules for every (branch, user type, item type), compiled from a rules
+// file into one flat table, so each borrow finds its rule by index alone.
+class LoanPolicyTable
+{
+private:
+    std::vector<std::string> branches;
+    std::vector<LoanPolicy> policies;
+
+    static size_t slot(size_t branch, UserType user, ItemType item)
+    {
+        return (branch * UserTypeCount + user) * ItemTypeCount + item;
+    }
+
+    // Returns -1 for "*", the matching index, or -2 if the name is unknown.
+    static int parseName(const std::string &name, const char *const names[], int count)
+    {
+        if (name == "*")
+            return -1;
+        for (int i = 0; i < count; ++i)
+        {
+            if (name == names[i])
+                return i;
+        }
+        return -2;
+    }
+
+public:
+    // Defaults: students keep items for 30 days, faculty for 6 months.
+    LoanPolicyTable() : branches(1, "main")
+    {
+        LoanPolicy student = {std::chrono::hours(24 * 30), 10, 2};
+        LoanPolicy faculty = {std::chrono::hours(24 * 30 * 6), 50, 4};
+        for (int item = 0; item < ItemTypeCount; ++item)
+            policies.push_back(student);
+        for (int item = 0; item < ItemTypeCount; ++item)
+            policies.push_back(faculty);
+        for (int user = 0; user < UserTypeCount; ++user)
+            policies[slot(0, static_cast<UserType>(user), LoanableItemType)].loanPeriod = std::chrono::hours(168); // 7 days
+    }
+
+    // Reads "user_type,item_type,branch,loan_days,max_items,max_renewals" rows,
+    // where "*" matches every value. Later rows override earlier ones.
+    bool load(const std::string &filename)
+    {
+        std::ifstream file(filename);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open file: " << filename << "\n";
+            return false;
+        }
+
+        static const char *const userNames[] = {"student", "faculty"};
+        static const char *const itemNames[] = {"book", "magazine", "journal", "loanable"};
+
+        struct Rule
+        {
+            int user, item, branch;
+            LoanPolicy policy;
+        };
+        std::vector<Rule> rules;
+
+        std::string line;
+        int lineNum = 0;
+        while (std::getline(file, line))
+        {
+            ++lineNum;
+            if (lineNum == 1 && line.compare(0, 9, "user_type") == 0)
+                continue;
+
+            std::istringstream iss(line);
+            std::string user, item, branch, days, maxItems, maxRenewals;
+            if (!std::getline(iss, user, ',') || !std::getline(iss, item, ',') || !std::getline(iss, branch, ',') ||
+                !std::getline(iss, days, ',') || !std::getline(iss, maxItems, ',') || !std::getline(iss, maxRenewals, ','))
+            {
+                std::cerr << "Invalid line format at line " << lineNum << "\n";
+                continue;
+            }
+
+            Rule rule;
+            rule.user = parseName(user, userNames, UserTypeCount);
+            rule.item = parseName(item, itemNames, ItemTypeCount);
+            if (rule.user == -2 || rule.item == -2)
+            {
+                std::cerr << "Unknown user or item type at line " << lineNum << "\n";
+                continue;
+            }
+            int loanDays;
+            try
+            {
+                loanDays = std::stoi(days);
+                rule.policy.maxItems = std::stoi(maxItems);
+                rule.policy.maxRenewals = std::stoi(maxRenewals);
+            }
+            catch (const std::exception &)
+            {
+                std::cerr << "Invalid number at line " << lineNum << "\n";
+                continue;
+            }
+            if (loanDays < 0 || loanDays > INT_MAX / 24 || rule.policy.maxItems < 0 || rule.policy.maxRenewals < 0)
+            {
+                std::cerr << "Loan days, item limit or renewals out of range at line " << lineNum << "\n";
+                continue;
+            }
+            rule.policy.loanPeriod = std::chrono::hours(24 * loanDays);
+
+            rule.branch = -1;
+            if (branch != "*")
+            {
+                rule.branch = branchIndex(branch);
+                if (rule.branch < 0)
+                {
+                    rule.branch = branches.size();
+                    branches.push_back(branch);
+                    // Copied first: inserting a range of a vector into itself is undefined
+                    std::vector<LoanPolicy> defaults(policies.begin(), policies.begin() + UserTypeCount * ItemTypeCount);
+                    policies.insert(policies.end(), defaults.begin(), defaults.end());
+                }
+            }
+            rules.push_back(rule);
+        }
+        file.close();
+
+        for (const auto &rule : rules)
+        {
+            for (size_t b = 0; b < branches.size(); ++b)
+                for (int u = 0; u < UserTypeCount; ++u)
+                    for (int i = 0; i < ItemTypeCount; ++i)
+                    {
+                        if ((rule.branch < 0 || rule.branch == static_cast<int>(b)) && (rule.user < 0 || rule.user == u) && (rule.item < 0 || rule.item == i))
+                            policies[slot(b, static_cast<UserType>(u), static_cast<ItemType>(i))] = rule.policy;
+                    }
+        }
+        return true;
+    }
+
+    // Returns -1 if the branch has no rules of its own.
+    int branchIndex(const std::string &name) const
+    {
+        for (size_t b = 0; b < branches.size(); ++b)
+        {
+            if (branches[b] == name)
+                return b;
+        }
+        return -1;
+    }
+
+    const LoanPolicy &lookup(UserType user, ItemType item, size_t branch = 0) const
+    {
+        return policies[slot(branch, user, item)];
+    }
+};
+
+const LoanPolicyTable &defaultLoanPolicies()
+{
+    static const LoanPolicyTable defaults;
+    return defaults;
+}
+
+// One item a user has borrowed, with the due date fixed by the policy at borrow time.
+struct LoanRecord
+{
+    std::chrono::system_clock::time_point borrowedAt;
+    std::chrono::system_clock::time_point dueAt;
+    ItemType type;
+    int renewals;
+};
+
+enum class LoanResult
+{
+    Done,
+    ItemNotFound,
+    NoCopiesLeft,
+    LimitReached,
+    NotBorrowed,
+    RenewalLimitReached,
+    HeldAsOtherType // The user already has this identifier on loan as another item type
+};
+
+const char *loanResultText(LoanResult result)
+{
+    switch (result)
+    {
+    case LoanResult::Done:
+        return "done";
+    case LoanResult::ItemNotFound:
+        return "item not found";
+    case LoanResult::NoCopiesLeft:
+        return "no copies left";
+    case LoanResult::LimitReached:
+        return "loan limit reached";
+    case LoanResult::NotBorrowed:
+        return "item not borrowed";
+    case LoanResult::RenewalLimitReached:
+        return "renewal limit reached";
+    case LoanResult::HeldAsOtherType:
+        return "already on loan as another item type";
+    }
+    return "unknown";
+}
+
+// FIFO queue of users waiting for a loanable item. Every hold gets the same
+// lifetime, so holds expire in queue order and stale ones are always at the front.
+class HoldQueue
+{
+private:
+    struct Hold
+    {
+        std::string username;
+        std::chrono::system_clock::time_point expiresAt;
+    };
+
+    std::deque<Hold> waiters;
+    std::unordered_set<std::string> queued; // Usernames in waiters, so a duplicate hold is found in O(1)
+    std::chrono::hours holdLifetime;
+
+public:
+    HoldQueue(std::chrono::hours lifetime = std::chrono::hours(24 * 14)) : holdLifetime(lifetime) {}
+
+    // Returns false if the user is already waiting.
+    bool placeHold(const std::string &username)
+    {
+        expireHolds();
+        if (!queued.insert(username).second)
+            return false;
+
+        Hold hold;
+        hold.username = username;
+        hold.expiresAt = std::chrono::system_clock::now() + holdLifetime;
+        waiters.push_back(hold);
+        return true;
+    }
+
+    void expireHolds()
+    {
+        auto now = std::chrono::system_clock::now();
+        while (!waiters.empty() && waiters.front().expiresAt <= now)
+        {
+            queued.erase(waiters.front().username);
+            waiters.pop_front();
+        }
+    }
+
+    // Removes the first waiter whose hold is still valid; returns false if nobody is waiting.
+    bool nextWaiter(std::string &username)
+    {
+        expireHolds();
+        if (waiters.empty())
+            return false;
+
+        username = waiters.front().username;
+        queued.erase(username);
+        waiters.pop_front();
+        return true;
+    }
+
+    size_t size() const
+    {
+        return waiters.size();
+    }
+};
+
+class LoanableItem : public PhysicalItem
+{
+private:
+    bool isOnLoan;
+    std::chrono::system_clock::time_point returnDate;
+    std::string borrower;
+    HoldQueue holds;
+
+public:
+    LoanableItem(const std::string &id, const std::string &loc, const std::string &duration)
+        : PhysicalItem(id, loc, duration), isOnLoan(false) {}
+
+    bool canBeBorrowed() const
+    {
+        return !isOnLoan;
+    }
+
+    // The loan period comes from the borrower's loan policy.
+    void borrow(const std::string &username, std::chrono::hours period)
+    {
+        isOnLoan = true;
+        borrower = username;
+        returnDate = std::chrono::system_clock::now() + period;
+    }
+
+    // Frees the item and hands it to the first waiter with a valid hold whose
+    // loan is accepted. acceptLoan(username, period) records the loan on that
+    // user and sets period from their policy, or returns false to skip them;
+    // loan limits live on User, which this class does not know about.
+    // Returns the new borrower, or an empty string if the item is now free.
+    template <typename AcceptLoan>
+    std::string returnItem(AcceptLoan acceptLoan)
+    {
+        isOnLoan = false;
+        borrower.clear();
+
+        std::string next;
+        std::chrono::hours period;
+        while (holds.nextWaiter(next))
+        {
+            if (acceptLoan(next, period))
+            {
+                borrow(next, period);
+                return next;
+            }
+        }
+        return std::string();
+    }
+
+    // Queues a user for the item; returns their position in the queue, or 0 if
+    // the user is the borrower or is already waiting.
+    size_t placeHold(const std::string &username)
+    {
+        if (username == borrower || !holds.placeHold(username))
+            return 0;
+        return holds.size();
+    }
+
+    size_t holdCount()
+    {
+        holds.expireHolds();
+        return holds.size();
+    }
+
+    bool isOnLoanStatus() const
+    {
+        return isOnLoan;
+    }
+
+    std::string getBorrower() const
+    {
+        return borrower;
+    }
+
+    std::chrono::system_clock::time_point getReturnDate() const
+    {
+        return returnDate;
+    }
+
+    virtual void displayInfo(std::ostream &out = std::cout) const override
+    {
+        PhysicalItem::displayInfo(out);
+        out << "Item is " << (isOnLoan ? "on loan until " : "available for borrowing") << std::chrono::system_clock::to_time_t(returnDate) << "\n";
+    }
+};
+
+// Mixes a 64-bit value so that nearby inputs spread over all bits.
+inline uint64_t mixHash(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint64_t hashString(const std::string &value)
+{
+    return mixHash(std::hash<std::string>()(value));
+}
+
+// SHA-256 (FIPS 180-4) of a byte string, used only to sign access links.
+std::string sha256(const std::string &message)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    std::string padded = message;
+    padded += static_cast<char>(0x80);
+    while (padded.size() % 64 != 56)
+        padded += static_cast<char>(0);
+    uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+    for (int shift = 56; shift >= 0; shift -= 8)
+        padded += static_cast<char>((bits >> shift) & 0xff);
+
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    for (size_t block = 0; block < padded.size(); block += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = 0;
+            for (int j = 0; j < 4; ++j)
+                w[i] = (w[i] << 8) | static_cast<unsigned char>(padded[block + i * 4 + j]);
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+
+    std::string digest;
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            digest += static_cast<char>((h[i] >> shift) & 0xff);
+    }
+    return digest;
+}
+
+// HMAC-SHA256 (RFC 2104) of message under key, as lowercase hex.
+std::string hmacSha256Hex(const std::string &key, const std::string &message)
+{
+    std::string block = key.size() > 64 ? sha256(key) : key;
+    block.resize(64, '\0');
+
+    std::string inner(64, '\0'), outer(64, '\0');
+    for (int i = 0; i < 64; ++i)
+    {
+        inner[i] = static_cast<char>(block[i] ^ 0x36);
+        outer[i] = static_cast<char>(block[i] ^ 0x5c);
+    }
+    std::string mac = sha256(outer + sha256(inner + message));
+
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char byte : mac)
+    {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xf];
+    }
+    return hex;
+}
+
+// Compact set of identifiers that can say "definitely not in the catalog"
+// without touching the catalog. It may wrongly say "maybe" (about 1% of the
+// time while not saturated) but never misses an identifier that was added.
+class BloomFilter
+{
+private:
+    static const int hashCount = 7;
+    std::vector<uint64_t, TrackingAllocator<uint64_t, CatalogIndexes>> words;
+    uint64_t bitMask;
+    size_t itemCount;
+    size_t capacity;
+
+public:
+    // Uses about 10 bits per expected identifier.
+    BloomFilter(size_t expectedItems = 1024) : itemCount(0), capacity(std::max<size_t>(expectedItems, 64))
+    {
+        size_t bits = 64;
+        while (bits < capacity * 10)
+            bits <<= 1;
+        words.assign(bits / 64, 0);
+        bitMask = bits - 1;
+    }
+
+    void add(const std::string &value)
+    {
+        uint64_t h1 = hashString(value);
+        uint64_t h2 = mixHash(h1) | 1;
+        for (int i = 0; i < hashCount; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) & bitMask;
+            words[bit >> 6] |= 1ULL << (bit & 63);
+        }
+        ++itemCount;
+    }
+
+    bool mightContain(const std::string &value) const
+    {
+        uint64_t h1 = hashString(value);
+        uint64_t h2 = mixHash(h1) | 1;
+        for (int i = 0; i < hashCount; ++i)
+        {
+            uint64_t bit = (h1 + i * h2) & bitMask;
+            if (!(words[bit >> 6] & (1ULL << (bit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    // True once more identifiers were added than the filter was sized for.
+    bool isSaturated() const
+    {
+        return itemCount > capacity;
+    }
+};
+
+// A seat taken on an electronic item. The seat is free again once expiresAtMs passes.
+struct SeatLease
+{
+    int seat;
+    long long expiresAtMs;
+    std::string link;
+};
+
+// An electronic item licensed for a fixed number of simultaneous readers.
+// Each seat is one atomic expiry time, so taking and freeing seats needs no lock
+// and a seat whose session has run out is reused without any cleanup.
+class ElectronicItem : public LibraryItem
+{
+protected:
+    CatalogString accessLink;
+    int seatCount;
+    std::chrono::minutes sessionLength;
+    std::unique_ptr<std::atomic<long long>[]> seatExpiry; // Milliseconds since epoch, 0 when never used
+
+    static long long nowMs()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Key for signing access links. Drawn once per process, so links from an
+    // earlier run are never accepted.
+    static const std::string &linkSecret()
+    {
+        static const std::string secret = []
+        {
+            std::random_device device;
+            std::string key;
+            for (int i = 0; i < 32; ++i)
+                key += static_cast<char>(device() & 0xff);
+            return key;
+        }();
+        return secret;
+    }
+
+    std::string accessToken(int seat, long long expiresAtMs) const
+    {
+        return hmacSha256Hex(linkSecret(), plainString(identifier) + "\n" + std::to_string(seat) + "\n" + std::to_string(expiresAtMs));
+    }
+
+    // Reads the value of "name=" from the query part of an access link.
+    static bool linkParameter(const std::string &query, const std::string &name, std::string &value)
+    {
+        size_t pos = 0;
+        while (pos < query.size())
+        {
+            size_t end = query.find('&', pos);
+            if (end == std::string::npos)
+                end = query.size();
+            if (query.compare(pos, name.size() + 1, name + "=") == 0)
+            {
+                value = query.substr(pos + name.size() + 1, end - pos - name.size() - 1);
+                return true;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    // Compares every character so the time taken does not reveal how much of a forged token matched.
+    static bool tokensEqual(const std::string &a, const std::string &b)
+    {
+        if (a.size() != b.size())
+            return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+            diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+        return diff == 0;
+    }
+
+public:
+    // seats and session must be positive; readEResourcesCSV rejects rows where they are not.
+    ElectronicItem(const std::string &id, const std::string &link, int seats = 1, std::chrono::minutes session = std::chrono::minutes(60))
+        : LibraryItem(id), accessLink(link.begin(), link.end()), seatCount(seats), sessionLength(session),
+          seatExpiry(new std::atomic<long long>[seats]())
+    {
+    }
+
+    virtual void displayInfo(std::ostream &out = std::cout) const override
+    {
+        out << "Identifier: " << identifier << ", Access Link: " << accessLink << ", Seats in use: " << seatsInUse() << "/" << seatCount << "\n";
+    }
+
+    std::string getIdentifier() const override
+    {
+        return plainString(identifier);
+    }
+
+    // Takes a free seat and issues a link that is valid until the session expires.
+    // Returns false if every seat is in use.
+    bool checkout(SeatLease &lease)
+    {
+        long long now = nowMs();
+        long long expiresAt = now + std::chrono::duration_cast<std::chrono::milliseconds>(sessionLength).count();
+
+        // Threads start looking at different seats so they rarely race for the same one
+        int start = std::hash<std::thread::id>()(std::this_thread::get_id()) % seatCount;
+        for (int i = 0; i < seatCount; ++i)
+        {
+            int seat = (start + i) % seatCount;
+            long long current = seatExpiry[seat].load();
+            if (current <= now && seatExpiry[seat].compare_exchange_strong(current, expiresAt))
+            {
+                lease.seat = seat;
+                lease.expiresAtMs = expiresAt;
+                lease.link = plainString(accessLink) + "?seat=" + std::to_string(seat) + "&expires=" + std::to_string(expiresAt) +
+                             "&token=" + accessToken(seat, expiresAt);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Recovers the lease from a presented access link. Returns false if the
+    // link was not issued by this item in this process or has been altered.
+    bool leaseFromLink(const std::string &link, SeatLease &lease) const
+    {
+        if (link.size() <= accessLink.size() || link.compare(0, accessLink.size(), accessLink.c_str(), accessLink.size()) != 0 ||
+            link[accessLink.size()] != '?')
+            return false;
+
+        std::string query = link.substr(accessLink.size() + 1), seat, expires, token;
+        if (!linkParameter(query, "seat", seat) || !linkParameter(query, "expires", expires) || !linkParameter(query, "token", token))
+            return false;
+
+        try
+        {
+            lease.seat = std::stoi(seat);
+            lease.expiresAtMs = std::stoll(expires);
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+        lease.link = link;
+        return lease.seat >= 0 && lease.seat < seatCount && tokensEqual(token, accessToken(lease.seat, lease.expiresAtMs));
+    }
+
+    // Frees the seat early. Does nothing if the link does not verify, or the
+    // lease has already expired and the seat was reused.
+    void release(const SeatLease &lease)
+    {
+        SeatLease presented;
+        if (!leaseFromLink(lease.link, presented) || presented.seat != lease.seat || presented.expiresAtMs != lease.expiresAtMs)
+            return;
+        long long expected = lease.expiresAtMs;
+        seatExpiry[lease.seat].compare_exchange_strong(expected, 0);
+    }
+
+    // A lease is valid while its link verifies and its seat is still held for it.
+    bool isLeaseValid(const SeatLease &lease) const
+    {
+        SeatLease presented;
+        return leaseFromLink(lease.link, presented) && presented.seat == lease.seat && presented.expiresAtMs == lease.expiresAtMs &&
+               seatExpiry[lease.seat].load() == lease.expiresAtMs && lease.expiresAtMs > nowMs();
+    }
+
+    int seatsInUse() const
+    {
+        long long now = nowMs();
+        int inUse = 0;
+        for (int seat = 0; seat < seatCount; ++seat)
+        {
+            if (seatExpiry[seat].load() > now)
+                ++inUse;
+        }
+        return inUse;
+    }
+};
+
+class Book : public PhysicalItem
+{
+private:
+    int count;
+
+public:
+    Book(const std::string &id, const std::string &loc, const std::string &duration,
+         int cnt, const std::string &isbnVal, const std::string &auth, const std::string &titleVal)
+        : PhysicalItem(id, makeRecord(loc, duration, isbnVal, auth, titleVal)), count(cnt) {}
+
+    Book(const std::string &id, int cnt, const CatalogSource *recordSource, size_t offset)
+        : PhysicalItem(id, recordSource, offset), count(cnt) {}
+
+    virtual void displayInfo(std::ostream &out = std::cout) const override
+    {
+        PhysicalItem::displayInfo(out);
+        out << "Type: Book, Count: " << count << " ISBN: " << getIsbn() << " Authors: " << getAuthors() << " Title: " << getTitle() << "\n";
+    }
+
+    int getCount() const
+    {
+        return count;
+    }
+
+    void addCopies(int copies)
+    {
+        count += copies;
+    }
+
+    std::string getIsbn() const
+    {
+        return plainString(record()->isbn);
+    }
+
+    std::string getAuthors() const
+    {
+        return plainString(record()->authors);
+    }
+
+    std::string getTitle() const
+    {
+        return plainString(record()->name);
+    }
+
+    std::string getIdentifier() const override
+    {
+        return plainString(identifier);
+    }
+};
+
+class Magazine : public PhysicalItem
+{
+public:
+    Magazine(const std::string &id, const std::string &loc, const std::string &duration, const std::string &pub)
+        : PhysicalItem(id, makeRecord(loc, duration, std::string(), std::string(), pub)) {}
+
+    Magazine(const std::string &id, const CatalogSource *recordSource, size_t offset)
+        : PhysicalItem(id, recordSource, offset) {}
+
+    virtual void displayInfo(std::ostream &out = std::cout) const override
+    {
+        out << "Identifier: " << getPublication() << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
+    }
+
+    std::string getPublication() const
+    {
+        return plainString(record()->name);
+    }
+};
+
+class Journal : public PhysicalItem
+{
+public:
+    Journal(const std::string &id, const std::string &loc, const std::string &duration, const std::string &name)
+        : PhysicalItem(id, makeRecord(loc, duration, std::string(), std::string(), name)) {}
+
+    Journal(const std::string &id, const CatalogSource *recordSource, size_t offset)
+        : PhysicalItem(id, recordSource, offset) {}
+
+    virtual void displayInfo(std::ostream &out = std::cout) const override
+    {
+        out << "Identifier: " << getJournalName() << ", Location: " << getLocation() << ", Return Duration: " << getReturnDuration() << "\n";
+    }
+
+    std::string getJournalName() const
+    {
+        return plainString(record()->name);
+    }
+
+    std::string getIdentifier() const override
+    {
+        return plainString(identifier);
+    }
+};
+
+typedef std::vector<Book, TrackingAllocator<Book, CatalogRecords>> BookList;
+typedef std::vector<Magazine, TrackingAllocator<Magazine, CatalogRecords>> MagazineList;
+typedef std::vector<Journal, TrackingAllocator<Journal, CatalogRecords>> JournalList;
+
+// Approximate per-key counts in fixed memory. Estimates never undercount.
+class CountMinSketch
+{
+private:
+    static const int depth = 4;
+    static const int width = 2048;
+    std::vector<uint32_t, TrackingAllocator<uint32_t, LoanStatistics>> table;
+
+public:
+    CountMinSketch() : table(depth * width, 0) {}
+
+    // Adds one occurrence and returns the new estimate for the key.
+    uint32_t add(const std::string &key)
+    {
+        uint64_t h = hashString(key);
+        uint32_t estimate = UINT32_MAX;
+        for (int row = 0; row < depth; ++row)
+        {
+            uint32_t &cell = table[row * width + (mixHash(h + row) % width)];
+            ++cell;
+            estimate = std::min(estimate, cell);
+        }
+        return estimate;
+    }
+
+    uint32_t estimate(const std::string &key) const
+    {
+        uint64_t h = hashString(key);
+        uint32_t estimate = UINT32_MAX;
+        for (int row = 0; row < depth; ++row)
+            estimate = std::min(estimate, table[row * width + (mixHash(h + row) % width)]);
+        return estimate;
+    }
+};
+
+// Distinct-count estimate with about 3% error using 1 KB of registers.
+class HyperLogLog
+{
+private:
+    static const int indexBits = 10;
+    static const int registerCount = 1 << indexBits;
+    std::vector<uint8_t, TrackingAllocator<uint8_t, LoanStatistics>> registers;
+
+public:
+    HyperLogLog() : registers(registerCount, 0) {}
+
+    void add(const std::string &value)
+    {
+        uint64_t h = hashString(value);
+        size_t index = h >> (64 - indexBits);
+        uint64_t rest = (h << indexBits) | (1ULL << (indexBits - 1));
+        uint8_t rank = 1;
+        while (!(rest & (1ULL << 63)))
+        {
+            ++rank;
+            rest <<= 1;
+        }
+        if (rank > registers[index])
+            registers[index] = rank;
+    }
+
+    double estimate() const
+    {
+        double sum = 0.0;
+        int zeros = 0;
+        for (uint8_t r : registers)
+        {
+            sum += std::ldexp(1.0, -r);
+            if (r == 0)
+                ++zeros;
+        }
+
+        double m = registerCount;
+        double raw = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+        if (raw <= 2.5 * m && zeros > 0)
+            return m * std::log(m / zeros); // Small range correction
+        return raw;
+    }
+};
+
+// Event counter over a sliding window made of fixed-size time buckets.
+class RateWindow
+{
+private:
+    std::vector<uint32_t, TrackingAllocator<uint32_t, LoanStatistics>> buckets;
+    std::vector<long long, TrackingAllocator<long long, LoanStatistics>> bucketStamps;
+    long long bucketSeconds;
+
+    static long long nowSeconds()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    RateWindow(size_t bucketCount = 168, long long secondsPerBucket = 3600)
+        : buckets(bucketCount, 0), bucketStamps(bucketCount, -1), bucketSeconds(secondsPerBucket) {}
+
+    void add()
+    {
+        long long stamp = nowSeconds() / bucketSeconds;
+        size_t slot = stamp % buckets.size();
+        if (bucketStamps[slot] != stamp)
+        {
+            bucketStamps[slot] = stamp;
+            buckets[slot] = 0;
+        }
+        ++buckets[slot];
+    }
+
+    uint64_t total() const
+    {
+        long long oldest = nowSeconds() / bucketSeconds - static_cast<long long>(buckets.size()) + 1;
+        uint64_t sum = 0;
+        for (size_t i = 0; i < buckets.size(); ++i)
+        {
+            if (bucketStamps[i] >= oldest)
+                sum += buckets[i];
+        }
+        return sum;
+    }
+
+    double ratePerHour() const
+    {
+        return total() * 3600.0 / (bucketSeconds * buckets.size());
+    }
+};
+
+// Loan statistics fed by every borrow and return. All state has a fixed size,
+// so memory does not grow with the number of titles or users.
+class LoanAnalytics
+{
+private:
+    static const size_t topK = 10;
+
+    template <typename Value>
+    using CounterMap = std::map<std::string, Value, std::less<std::string>, TrackingAllocator<std::pair<const std::string, Value>, LoanStatistics>>;
+
+    CountMinSketch itemCounts;
+    CounterMap<uint32_t> heavyHitters;
+    HyperLogLog borrowers;
+    CounterMap<RateWindow> borrowRates;
+    CounterMap<RateWindow> returnRates;
+    mutable std::mutex lock; // Batch users record from the LoanExecutor threads
+
+    void trackHeavyHitter(const std::string &itemIdentifier, uint32_t estimate)
+    {
+        auto it = heavyHitters.find(itemIdentifier);
+        if (it != heavyHitters.end())
+        {
+            it->second = estimate;
+            return;
+        }
+        if (heavyHitters.size() < topK)
+        {
+            heavyHitters[itemIdentifier] = estimate;
+            return;
+        }
+
+        auto smallest = heavyHitters.begin();
+        for (auto h = heavyHitters.begin(); h != heavyHitters.end(); ++h)
+        {
+            if (h->second < smallest->second)
+                smallest = h;
+        }
+        if (estimate > smallest->second)
+        {
+            heavyHitters.erase(smallest);
+            heavyHitters[itemIdentifier] = estimate;
+        }
+    }
+
+public:
+    void recordBorrow(const std::string &username, const std::string &itemIdentifier, const std::string &itemType)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        trackHeavyHitter(itemIdentifier, itemCounts.add(itemIdentifier));
+        borrowers.add(username);
+        borrowRates[itemType].add();
+    }
+
+    void recordReturn(const std::string &itemType)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        returnRates[itemType].add();
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> mostBorrowed() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::vector<std::pair<std::string, uint32_t>> result(heavyHitters.begin(), heavyHitters.end());
+        std::sort(result.begin(), result.end(), [](const std::pair<std::string, uint32_t> &a, const std::pair<std::string, uint32_t> &b) {
+            return a.second > b.second;
+        });
+        return result;
+    }
+
+    uint64_t distinctBorrowers() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return static_cast<uint64_t>(borrowers.estimate() + 0.5);
+    }
+
+    void displayStatistics(std::ostream &out = std::cout) const
+    {
+        out << "Most borrowed items:\n";
+        for (const auto &item : mostBorrowed())
+            out << "  " << item.first << " (~" << item.second << " loans)\n";
+
+        out << "Distinct borrowers: ~" << distinctBorrowers() << "\n";
+
+        std::lock_guard<std::mutex> guard(lock);
+        out << "Borrows in the last 7 days by type:\n";
+        for (const auto &rate : borrowRates)
+            out << "  " << rate.first << ": " << rate.second.total() << " (" << rate.second.ratePerHour() << " per hour)\n";
+
+        out << "Returns in the last 7 days by type:\n";
+        for (const auto &rate : returnRates)
+            out << "  " << rate.first << ": " << rate.second.total() << "\n";
+    }
+};
+
+// Copies of one book that are lent out. The inventory report takes them from
+// the book's count, so a row exists only for books that were ever lent.
+struct InventoryRow
+{
+    int copiesOnLoan;
+};
+
+// Copies a loan took from, or a return put back into, the book at a catalog position.
+struct StockChange
+{
+    size_t book;
+    int copies; // 0 for items without a copy limit
+};
+
+struct LoanRow
+{
+    ReportString username;
+    ReportString identifier;
+    std::chrono::system_clock::time_point dueAt;
+    bool active;
+};
+
+// Rows kept in a tree of 64-way nodes that are never changed once published.
+// Changing or adding a row copies only the nodes on the path from the root to
+// its leaf; every other node is shared with older versions, so a write costs
+// O(log rows) and copying a whole table is one pointer copy.
+template <typename Row>
+struct SnapshotTable
+{
+    static const size_t fanout = 64;
+
+    struct Node
+    {
+        std::vector<std::shared_ptr<const Node>, TrackingAllocator<std::shared_ptr<const Node>, ReportTables>> children; // Inner nodes only
+        std::vector<Row, TrackingAllocator<Row, ReportTables>> rows;                                                     // Leaves only
+    };
+
+    static std::shared_ptr<Node> makeNode(const Node &from = Node())
+    {
+        return std::allocate_shared<Node>(TrackingAllocator<Node, ReportTables>(), from);
+    }
+
+    std::shared_ptr<const Node> root;
+    size_t depth; // Number of inner levels above the leaves
+    size_t rowCount;
+
+    SnapshotTable() : depth(0), rowCount(0) {}
+
+    // Rows under one child of a node at the given level.
+    static size_t span(size_t level)
+    {
+        size_t rows = 1;
+        for (size_t i = 0; i < level; ++i)
+            rows *= fanout;
+        return rows;
+    }
+
+    // Rows never set, left by writers that published out of order, read as Row().
+    const Row &row(size_t index) const
+    {
+        static const Row unset = Row();
+        const Node *node = root.get();
+        for (size_t level = depth; node && level > 0; --level)
+        {
+            size_t slot = (index / span(level)) % fanout;
+            node = slot < node->children.size() ? node->children[slot].get() : nullptr;
+        }
+        if (!node || index % fanout >= node->rows.size())
+            return unset;
+        return node->rows[index % fanout];
+    }
+
+    // Sets any row, growing the table past rowCount if needed.
+    void set(size_t index, const Row &value)
+    {
+        while (index >= span(depth + 1))
+        {
+            if (root)
+            {
+                std::shared_ptr<Node> taller = makeNode();
+                taller->children.push_back(root);
+                root = taller;
+            }
+            ++depth;
+        }
+        root = withRow(root, depth, index, value);
+        rowCount = std::max(rowCount, index + 1);
+    }
+
+private:
+    // Returns a copy of node with row index set to value, sharing every child
+    // that is not on the way to that row.
+    static std::shared_ptr<const Node> withRow(const std::shared_ptr<const Node> &node, size_t level, size_t index, const Row &value)
+    {
+        std::shared_ptr<Node> copy = node ? makeNode(*node) : makeNode();
+        if (level == 0)
+        {
+            size_t slot = index % fanout;
+            if (slot >= copy->rows.size())
+                copy->rows.resize(slot + 1);
+            copy->rows[slot] = value;
+        }
+        else
+        {
+            size_t slot = (index / span(level)) % fanout;
+            if (slot >= copy->children.size())
+                copy->children.resize(slot + 1);
+            copy->children[slot] = withRow(copy->children[slot], level - 1, index, value);
+        }
+        return copy;
+    }
+};
+
+// One consistent point-in-time view of inventory and loans.
+struct ReportSnapshot
+{
+    uint64_t version;
+    SnapshotTable<InventoryRow> inventory; // Indexed by book position
+    SnapshotTable<LoanRow> loans;
+
+    ReportSnapshot() : version(0) {}
+};
+
+// Multi-version copy-on-write state for reports. A writer builds the next
+// version from the latest one without holding any lock and publishes it with
+// an atomic compare-and-swap, rebuilding it if another writer got there first.
+// Readers grab the current version without locking and keep it as long as
+// they need; a version is freed when its last reader lets go of it.
+class ReportSnapshots
+{
+private:
+    std::shared_ptr<const ReportSnapshot> current;
+
+    // Which row holds which loan. Rows are handed out under rowLock before a
+    // version is built, so racing writers never pick the same row.
+    std::mutex rowLock;
+    std::map<std::pair<std::string, std::string>, size_t, std::less<std::pair<std::string, std::string>>,
+             TrackingAllocator<std::pair<const std::pair<std::string, std::string>, size_t>, ReportTables>> loanRows; // Active loans only
+    std::vector<size_t, TrackingAllocator<size_t, ReportTables>> freeLoanRows; // Rows of returned loans, reused by the next new loan
+    size_t loanRowCount;
+
+    static std::shared_ptr<ReportSnapshot> makeSnapshot(const ReportSnapshot &from = ReportSnapshot())
+    {
+        return std::allocate_shared<ReportSnapshot>(TrackingAllocator<ReportSnapshot, ReportTables>(), from);
+    }
+
+    // Applies change to a copy of the latest version and publishes it. The
+    // copy only duplicates the table roots, not the rows. change may run more
+    // than once, each time on a newer version, so it must only read the
+    // version it is given.
+    template <typename Change>
+    void write(Change change)
+    {
+        std::shared_ptr<const ReportSnapshot> latest = std::atomic_load(&current);
+        std::shared_ptr<const ReportSnapshot> next;
+        do
+        {
+            std::shared_ptr<ReportSnapshot> draft = makeSnapshot(*latest);
+            ++draft->version;
+            change(*draft);
+            next = draft;
+        } while (!std::atomic_compare_exchange_weak(&current, &latest, next));
+    }
+
+    size_t loanRow(const std::string &username, const std::string &itemIdentifier)
+    {
+        std::lock_guard<std::mutex> guard(rowLock);
+        auto key = std::make_pair(username, itemIdentifier);
+        auto it = loanRows.find(key);
+        if (it != loanRows.end())
+            return it->second;
+        if (freeLoanRows.empty())
+            return loanRows[key] = loanRowCount++;
+        size_t row = freeLoanRows.back();
+        freeLoanRows.pop_back();
+        return loanRows[key] = row;
+    }
+
+    bool releaseLoanRow(const std::string &username, const std::string &itemIdentifier, size_t &row)
+    {
+        std::lock_guard<std::mutex> guard(rowLock);
+        auto it = loanRows.find(std::make_pair(username, itemIdentifier));
+        if (it == loanRows.end())
+            return false;
+        row = it->second;
+        loanRows.erase(it);
+        return true;
+    }
+
+    // A row is reused only once the version clearing it is published, so the
+    // clear can never land on top of the row's next loan.
+    void reuseLoanRow(size_t row)
+    {
+        std::lock_guard<std::mutex> guard(rowLock);
+        freeLoanRows.push_back(row);
+    }
+
+    static void lendCopies(ReportSnapshot &next, const StockChange &change, int direction)
+    {
+        if (change.copies == 0)
+            return;
+        InventoryRow row = next.inventory.row(change.book);
+        row.copiesOnLoan += direction * change.copies;
+        next.inventory.set(change.book, row);
+    }
+
+public:
+    ReportSnapshots() : current(makeSnapshot()), loanRowCount(0) {}
+
+    std::shared_ptr<const ReportSnapshot> snapshot() const
+    {
+        return std::atomic_load(&current);
+    }
+
+    // taken is what the loan took from the book's stock (no copies for
+    // unlimited items and renewals). The loan and the stock change are
+    // published in the same version, so no report sees one without the other.
+    void recordLoan(const std::string &username, const std::string &itemIdentifier, std::chrono::system_clock::time_point dueAt,
+                    const StockChange &taken = StockChange())
+    {
+        LoanRow row = {ReportString(username.begin(), username.end()), ReportString(itemIdentifier.begin(), itemIdentifier.end()), dueAt, true};
+        size_t index = loanRow(username, itemIdentifier);
+        write([&](ReportSnapshot &next) {
+            next.loans.set(index, row);
+            lendCopies(next, taken, 1);
+        });
+    }
+
+    // Marks the loan's row inactive and frees it for reuse, so the loan table
+    // only grows with the most loans ever held at once. returned goes back to
+    // the book's stock in the same version.
+    void recordReturn(const std::string &username, const std::string &itemIdentifier, const StockChange &returned = StockChange())
+    {
+        size_t index;
+        bool clearsLoan = releaseLoanRow(username, itemIdentifier, index);
+        if (!clearsLoan && returned.copies == 0)
+            return;
+        write([&](ReportSnapshot &next) {
+            if (clearsLoan)
+                next.loans.set(index, LoanRow());
+            lendCopies(next, returned, -1);
+        });
+        if (clearsLoan)
+            reuseLoanRow(index);
+    }
+};
+
+void printLoanReport(const ReportSnapshot &snapshot, std::ostream &out)
+{
+    std::map<std::string, std::vector<const LoanRow *>> loansByUser;
+    for (size_t i = 0; i < snapshot.loans.rowCount; ++i)
+    {
+        const LoanRow &row = snapshot.loans.row(i);
+        if (row.active)
+            loansByUser[plainString(row.username)].push_back(&row);
+    }
+
+    out << "Borrowed items for all users (version " << snapshot.version << "):\n";
+    for (const auto &user : loansByUser)
+    {
+        out << "User " << user.first << ":\n";
+        for (const LoanRow *row : user.second)
+            out << "  " << row->identifier << ", Due Date: " << std::chrono::system_clock::to_time_t(row->dueAt) << "\n";
+    }
+}
+
+class User
+{
+private:
+    std::string username;
+    std::map<std::string, LoanRecord, std::less<std::string>, TrackingAllocator<std::pair<const std::string, LoanRecord>, LoanMaps>> borrowedItems;
+    LoanAnalytics *analytics;
+    ReportSnapshots *reports;
+    const LoanPolicyTable *policies;
+    UserType userType;
+    int heldCount[ItemTypeCount]; // Items held per type, so limit checks do not scan the loans
+
+public:
+    User(const std::string &name)
+        : username(name), analytics(nullptr), reports(nullptr), policies(&defaultLoanPolicies()), userType(StudentUser), heldCount() {}
+
+    void setReports(ReportSnapshots *reportSnapshots)
+    {
+        reports = reportSnapshots;
+    }
+
+    void setLoanPolicies(const LoanPolicyTable *loanPolicies)
+    {
+        policies = loanPolicies;
+    }
+
+    const LoanPolicy &loanPolicy(ItemType type) const
+    {
+        return policies->lookup(userType, type);
+    }
+
+    bool canBorrow(ItemType type) const
+    {
+        return heldCount[type] < loanPolicy(type).maxItems;
+    }
+
+    void setAnalytics(LoanAnalytics *loanAnalytics)
+    {
+        analytics = loanAnalytics;
+    }
+
+    // Borrowing an item the user already holds renews that loan, within the
+    // renewal limit. An identifier held as another item type (a regular loan
+    // versus an item on loan) is refused, so heldCount never moves between types.
+    // taken is reported with the loan, in the same report version.
+    LoanResult borrowItem(const std::string &itemIdentifier, ItemType type, const StockChange &taken = StockChange())
+    {
+        auto it = borrowedItems.find(itemIdentifier);
+        if (it != borrowedItems.end())
+            return it->second.type == type ? renewItem(itemIdentifier) : LoanResult::HeldAsOtherType;
+        if (!canBorrow(type))
+            return LoanResult::LimitReached;
+        ++heldCount[type];
+
+        if (analytics)
+            analytics->recordBorrow(username, itemIdentifier, itemTypeName(type));
+
+        LoanRecord &loan = borrowedItems[itemIdentifier];
+        loan.borrowedAt = std::chrono::system_clock::now();
+        loan.dueAt = loan.borrowedAt + loanPolicy(type).loanPeriod;
+        loan.type = type;
+        loan.renewals = 0;
+
+        if (reports)
+            reports->recordLoan(username, itemIdentifier, loan.dueAt, taken);
+        return LoanResult::Done;
+    }
+
+    // Extends the loan by one loan period from now, up to the policy's renewal limit.
+    LoanResult renewItem(const std::string &itemIdentifier)
+    {
+        auto it = borrowedItems.find(itemIdentifier);
+        if (it == borrowedItems.end())
+            return LoanResult::NotBorrowed;
+
+        LoanRecord &loan = it->second;
+        if (loan.renewals >= loanPolicy(loan.type).maxRenewals)
+            return LoanResult::RenewalLimitReached;
+        ++loan.renewals;
+        loan.dueAt = std::chrono::system_clock::now() + loanPolicy(loan.type).loanPeriod;
+
+        if (reports)
+            reports->recordLoan(username, itemIdentifier, loan.dueAt);
+        return LoanResult::Done;
+    }
+
+    void returnItem(const std::string &itemIdentifier, const StockChange &returned = StockChange())
+    {
+        auto it = borrowedItems.find(itemIdentifier);
+        if (it == borrowedItems.end())
+            return;
+
+        if (analytics)
+            analytics->recordReturn(itemTypeName(it->second.type));
+        if (reports)
+            reports->recordReturn(username, itemIdentifier, returned);
+        --heldCount[it->second.type];
+        borrowedItems.erase(it);
+    }
+
+    std::string getUsername() const
+    {
+        return username;
+    }
+
+    bool hasBorrowed(const std::string &itemIdentifier) const
+    {
+        return borrowedItems.count(itemIdentifier) > 0;
+    }
+
+    bool hasBorrowed(const std::string &itemIdentifier, ItemType type) const
+    {
+        auto it = borrowedItems.find(itemIdentifier);
+        return it != borrowedItems.end() && it->second.type == type;
+    }
+
+    // With a catalog filter, items that are certainly not in the catalog skip the scans.
+    void displayBorrowedItems(const BookList &books, const MagazineList &magazines, const JournalList &journals,
+                              std::ostream &out = std::cout, const BloomFilter *catalogFilter = nullptr) const
+    {
+        out << "Borrowed Items for User " << username << ":\n";
+        for (const auto &borrowedItem : borrowedItems)
+        {
+            const std::string &itemIdentifier = borrowedItem.first;
+
+            out << "Item Identifier: " << itemIdentifier << ", Borrowed Date: " << std::chrono::system_clock::to_time_t(borrowedItem.second.borrowedAt)
+                << ", Due Date: " << std::chrono::system_clock::to_time_t(borrowedItem.second.dueAt) << ", Details:\n";
+
+            if (catalogFilter && !catalogFilter->mightContain(itemIdentifier))
+            {
+                out << "Item not found.\n";
+                continue;
+            }
+
+            bool found = false;
+
+            for (const auto &book : books)
+            {
+                if (book.getIdentifier() == itemIdentifier)
+                {
+                    book.displayInfo(out);
+                    found = true;
+                    break;
+                }
+            }
+
+            for (const auto &magazine : magazines)
+            {
+                if (magazine.getIdentifier() == itemIdentifier)
+                {
+                    magazine.displayInfo(out);
+                    found = true;
+                    break;
+                }
+            }
+
+            for (const auto &journal : journals)
+            {
+                if (journal.getIdentifier() == itemIdentifier)
+                {
+                    journal.displayInfo(out);
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found)
+                out << "Item not found.\n";
+        }
+    }
+};
+
+void readBooksCSV(const std::string &filename, BookList &books)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNum;
+
+        int count;
+        std::string isbn, authors, title;
+        if (!parseBookLine(line, lineNum, count, isbn, authors, title))
+            continue;
+
+        std::string loc = "Unknown location";
+        std::string duration = "Unknown duration";
+        books.emplace_back(isbn, loc, duration, count, isbn, authors, title);
+    }
+
+    file.close();
+}
+
+// Lazy catalog mode: keeps only the identifier, count and record offset of each book.
+void readBooksLazily(const CatalogSource &source, BookList &books)
+{
+    books.reserve(books.size() + source.lineCount());
+    int lineNum = 0;
+    source.forEachLine([&](size_t offset, const char *line, size_t length) {
+        ++lineNum;
+
+        int count;
+        std::string isbn;
+        if (parseBookKey(line, length, lineNum, count, isbn))
+            books.emplace_back(isbn, count, &source, offset);
+    });
+}
+
+// Lazy catalog mode for magazines.csv and journals.csv: each line is the identifier.
+template <typename ItemList>
+void readNamesLazily(const CatalogSource &source, ItemList &items)
+{
+    items.reserve(items.size() + source.lineCount());
+    source.forEachLine([&](size_t offset, const char *line, size_t length) { items.emplace_back(std::string(line, length), &source, offset); });
+}
+
+// Where the next page of an ordered index listing starts.
+template <typename Key>
+struct PageCursor
+{
+    std::pair<Key, size_t> last;
+    bool started;
+    bool finished;
+    std::set<size_t> shown; // Positions already returned, for indexes with several keys per position
+
+    PageCursor() : started(false), finished(false) {}
+};
+
+// Balanced tree of (key, position) pairs, charged to the catalog indexes.
+template <typename Key>
+using OrderedIndex = std::set<std::pair<Key, size_t>, std::less<std::pair<Key, size_t>>, TrackingAllocator<std::pair<Key, size_t>, CatalogIndexes>>;
+
+// Identifier index, identifier filter and ordered secondary indexes over the catalog.
+// The ordered indexes are balanced trees of (key, position) pairs, so a page
+// of results costs one O(log n) seek plus the page itself. The identifier
+// index keeps only book positions and compares against the identifiers in the
+// book list, which stays the one copy of every identifier.
+class CatalogIndex
+{
+private:
+    const BookList &books;
+    std::vector<uint32_t, TrackingAllocator<uint32_t, CatalogIndexes>> bookSlots; // Open addressing; position + 1, or 0 for an empty slot
+    size_t indexedBooks;
+    BloomFilter identifiers;
+
+    OrderedIndex<int> booksByCount;
+    OrderedIndex<IndexString> booksByAuthors; // One entry per author of each book
+    OrderedIndex<IndexString> booksByTitle;
+    OrderedIndex<IndexString> itemsByType[3]; // Identifier and position per catalog list
+    bool booksIndexed; // The ordered book indexes are built on first use for a lazy catalog
+
+    // Returns up to pageSize positions starting at from (or after the cursor),
+    // stopping at the first key for which inRange is false. With distinct set,
+    // a position already returned under another key is skipped.
+    template <typename Key, typename InRange>
+    static std::vector<size_t> page(const OrderedIndex<Key> &index, const std::pair<Key, size_t> &from, InRange inRange,
+                                    size_t pageSize, PageCursor<Key> &cursor, bool distinct = false)
+    {
+        std::vector<size_t> positions;
+        if (cursor.finished)
+            return positions;
+
+        auto it = cursor.started ? index.upper_bound(cursor.last) : index.lower_bound(from);
+        for (; it != index.end() && positions.size() < pageSize && inRange(it->first); ++it)
+        {
+            cursor.last = *it;
+            if (distinct && !cursor.shown.insert(it->second).second)
+                continue;
+            positions.push_back(it->second);
+        }
+        cursor.started = true;
+        cursor.finished = it == index.end() || !inRange(it->first);
+        return positions;
+    }
+
+    static bool hasPrefix(const IndexString &value, const std::string &prefix)
+    {
+        return value.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), value.begin());
+    }
+
+    static std::pair<IndexString, size_t> entry(const std::string &key, size_t position)
+    {
+        return std::make_pair(IndexString(key.begin(), key.end()), position);
+    }
+
+    // Adds one entry per author in a comma-separated author list.
+    void addAuthors(const std::string &authors, size_t position)
+    {
+        size_t start = 0;
+        while (start <= authors.size())
+        {
+            size_t end = authors.find(',', start);
+            if (end == std::string::npos)
+                end = authors.size();
+            size_t first = authors.find_first_not_of(' ', start);
+            if (first != std::string::npos && first < end)
+                booksByAuthors.insert(entry(authors.substr(first, end - first), position));
+            start = end + 1;
+        }
+    }
+
+    // The slot holding the book with this identifier, or the empty slot where it would go.
+    size_t findSlot(const std::string &itemIdentifier) const
+    {
+        size_t mask = bookSlots.size() - 1;
+        for (size_t slot = hashString(itemIdentifier) & mask;; slot = (slot + 1) & mask)
+        {
+            uint32_t entry = bookSlots[slot];
+            if (entry == 0 || books[entry - 1].hasIdentifier(itemIdentifier))
+                return slot;
+        }
+    }
+
+    // Keeps the table at most half full, so probe runs stay short.
+    void growSlots(size_t bookCount)
+    {
+        size_t size = 16;
+        while (size < 2 * bookCount)
+            size <<= 1;
+        if (size <= bookSlots.size())
+            return;
+
+        std::vector<uint32_t, TrackingAllocator<uint32_t, CatalogIndexes>> old(size, 0);
+        old.swap(bookSlots);
+        for (uint32_t entry : old)
+        {
+            if (entry != 0)
+                bookSlots[findSlot(books[entry - 1].getIdentifier())] = entry;
+        }
+    }
+
+    bool findMagazineOrJournal(const std::string &itemIdentifier, ItemType &type, size_t &position) const
+    {
+        IndexString key(itemIdentifier.begin(), itemIdentifier.end());
+        for (ItemType listType : {MagazineItem, JournalItem})
+        {
+            auto it = itemsByType[listType].lower_bound(std::make_pair(key, size_t(0)));
+            if (it != itemsByType[listType].end() && it->first == key)
+            {
+                type = listType;
+                position = it->second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void rebuildFilter()
+    {
+        identifiers = BloomFilter(2 * (indexedBooks + itemsByType[MagazineItem].size() + itemsByType[JournalItem].size()));
+        for (const auto &book : books)
+            identifiers.add(book.getIdentifier());
+        for (ItemType type : {MagazineItem, JournalItem})
+        {
+            for (const auto &item : itemsByType[type])
+                identifiers.add(plainString(item.first));
+        }
+    }
+
+public:
+    CatalogIndex(const BookList &bookList, const MagazineList &magazines, const JournalList &journals)
+        : books(bookList), indexedBooks(0), booksIndexed(false)
+    {
+        growSlots(books.size());
+        for (size_t i = 0; i < books.size(); ++i)
+        {
+            size_t slot = findSlot(books[i].getIdentifier());
+            if (bookSlots[slot] == 0) // First record wins
+            {
+                bookSlots[slot] = static_cast<uint32_t>(i + 1);
+                ++indexedBooks;
+            }
+        }
+        if (books.empty() || !books.front().isLazy())
+            indexBooks();
+
+        for (size_t i = 0; i < magazines.size(); ++i)
+            itemsByType[MagazineItem].insert(entry(magazines[i].getIdentifier(), i));
+        for (size_t i = 0; i < journals.size(); ++i)
+            itemsByType[JournalItem].insert(entry(journals[i].getIdentifier(), i));
+        rebuildFilter();
+    }
+
+    // False means the identifier is certainly not in the catalog.
+    bool mightContain(const std::string &itemIdentifier) const
+    {
+        return identifiers.mightContain(itemIdentifier);
+    }
+
+    const BloomFilter &getFilter() const
+    {
+        return identifiers;
+    }
+
+    // Finds the catalog list holding the identifier and the item's position in it.
+    bool findItem(const std::string &itemIdentifier, ItemType &type, size_t &position) const
+    {
+        if (!identifiers.mightContain(itemIdentifier))
+            return false;
+        long book = findBook(itemIdentifier);
+        if (book < 0)
+            return findMagazineOrJournal(itemIdentifier, type, position);
+        type = BookItem;
+        position = static_cast<size_t>(book);
+        return true;
+    }
+
+    // True if a magazine or journal has this identifier.
+    bool isMagazineOrJournal(const std::string &itemIdentifier) const
+    {
+        ItemType type;
+        size_t position;
+        return identifiers.mightContain(itemIdentifier) && findMagazineOrJournal(itemIdentifier, type, position);
+    }
+
+    // Returns the position of the book, or -1 if it is not in the catalog.
+    long findBook(const std::string &itemIdentifier) const
+    {
+        if (bookSlots.empty())
+            return -1;
+        uint32_t entry = bookSlots[findSlot(itemIdentifier)];
+        return entry == 0 ? -1 : static_cast<long>(entry - 1);
+    }
+
+    // Indexes the book already stored at this position of the book list.
+    void addBook(size_t position)
+    {
+        growSlots(indexedBooks + 1);
+        size_t slot = findSlot(books[position].getIdentifier());
+        if (bookSlots[slot] != 0)
+            return;
+        bookSlots[slot] = static_cast<uint32_t>(position + 1);
+        ++indexedBooks;
+
+        identifiers.add(books[position].getIdentifier());
+        if (identifiers.isSaturated())
+            rebuildFilter();
+    }
+
+    // Adds a book at its final position to the ordered indexes, once they are built.
+    void addBookDetails(const Book &book, size_t position)
+    {
+        if (!booksIndexed)
+            return;
+        booksByCount.insert(std::make_pair(book.getCount(), position));
+        addAuthors(book.getAuthors(), position);
+        booksByTitle.insert(entry(book.getTitle(), position));
+        itemsByType[BookItem].insert(entry(book.getIdentifier(), position));
+    }
+
+    // Builds the ordered book indexes. This decodes every book, so a lazy
+    // catalog only does it the first time books are browsed.
+    void indexBooks()
+    {
+        if (booksIndexed)
+            return;
+        booksIndexed = true;
+        for (size_t i = 0; i < books.size(); ++i)
+            addBookDetails(books[i], i);
+    }
+
+    // Adds copies to an indexed book and moves it in the count index.
+    void addCopies(BookList &bookList, size_t position, int copies)
+    {
+        if (booksIndexed)
+            booksByCount.erase(std::make_pair(bookList[position].getCount(), position));
+        bookList[position].addCopies(copies);
+        if (booksIndexed)
+            booksByCount.insert(std::make_pair(bookList[position].getCount(), position));
+    }
+
+    std::vector<size_t> booksByAuthorPrefix(const std::string &prefix, size_t pageSize, PageCursor<IndexString> &cursor) const
+    {
+        return page(booksByAuthors, entry(prefix, 0), [&](const IndexString &key) { return hasPrefix(key, prefix); }, pageSize, cursor, true);
+    }
+
+    std::vector<size_t> booksByTitlePrefix(const std::string &prefix, size_t pageSize, PageCursor<IndexString> &cursor) const
+    {
+        return page(booksByTitle, entry(prefix, 0), [&](const IndexString &key) { return hasPrefix(key, prefix); }, pageSize, cursor);
+    }
+
+    // Books whose count is in [minCount, maxCount], fewest copies first.
+    std::vector<size_t> booksByCountRange(int minCount, int maxCount, size_t pageSize, PageCursor<int> &cursor) const
+    {
+        return page(booksByCount, std::make_pair(minCount, size_t(0)), [&](int key) { return key <= maxCount; }, pageSize, cursor);
+    }
+
+    // Positions in the list of the given type, ordered by identifier.
+    std::vector<size_t> itemsOfType(ItemType type, size_t pageSize, PageCursor<IndexString> &cursor) const
+    {
+        return page(itemsByType[type], entry(std::string(), 0), [](const IndexString &) { return true; }, pageSize, cursor);
+    }
+};
+
+// Exact membership test. Most unknown identifiers are rejected by the filter before any scan.
+bool catalogContains(const std::string &itemIdentifier, const CatalogIndex &index, const MagazineList &magazines, const JournalList &journals)
+{
+    if (!index.mightContain(itemIdentifier))
+        return false;
+    if (index.findBook(itemIdentifier) >= 0)
+        return true;
+    for (const auto &magazine : magazines)
+    {
+        if (magazine.getIdentifier() == itemIdentifier)
+            return true;
+    }
+    for (const auto &journal : journals)
+    {
+        if (journal.getIdentifier() == itemIdentifier)
+            return true;
+    }
+    return false;
+}
+
+// Copies left of each item as of one report version. A book's count is its
+// copies owned, so the copies left are the count minus those on loan.
+void printInventoryReport(const ReportSnapshot &snapshot, const CatalogIndex &index, const BookList &books,
+                          const MagazineList &magazines, const JournalList &journals, std::ostream &out)
+{
+    out << "Inventory report (version " << snapshot.version << "):\n";
+    for (size_t i = 0; i < books.size(); ++i)
+    {
+        std::string identifier = books[i].getIdentifier();
+        if (index.findBook(identifier) != static_cast<long>(i))
+            continue; // A repeated record; loans use the first one
+        out << "Book: " << identifier << ", Copies: ";
+        if (books[i].getCount() < 0)
+            out << "unlimited\n";
+        else
+            out << books[i].getCount() - snapshot.inventory.row(i).copiesOnLoan << "\n";
+    }
+    for (const auto &magazine : magazines)
+        out << "Magazine: " << magazine.getIdentifier() << ", Copies: unlimited\n";
+    for (const auto &journal : journals)
+        out << "Journal: " << journal.getIdentifier() << ", Copies: unlimited\n";
+}
+
+void readMagazinesCSV(const std::string &filename, MagazineList &magazines)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::string publication = line;
+
+        std::string loc = "Unknown location";
+        std::string duration = "Unknown duration";
+
+        magazines.emplace_back(publication, loc, duration, publication);
+    }
+
+    file.close();
+}
+
+void readJournalsCSV(const std::string &filename, JournalList &journals)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::string journalName = line;
+
+        std::string loc = "Unknown location";
+        std::string duration = "Unknown duration";
+
+        journals.emplace_back(journalName, loc, duration, journalName);
+    }
+
+    file.close();
+}
+
+// Reads "identifier,seats,session_minutes,access_link" rows.
+void readEResourcesCSV(const std::string &filename, std::vector<ElectronicItem> &eresources)
+{
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNum;
+        if (lineNum == 1 && line.compare(0, 10, "identifier") == 0)
+            continue;
+
+        std::istringstream iss(line);
+        std::string identifier, seats, minutes, link;
+        if (!std::getline(iss, identifier, ',') || !std::getline(iss, seats, ',') || !std::getline(iss, minutes, ',') || !std::getline(iss, link))
+        {
+            std::cerr << "Invalid line format at line " << lineNum << "\n";
+            continue;
+        }
+
+        int seatCount, sessionMinutes;
+        try
+        {
+            seatCount = std::stoi(seats);
+            sessionMinutes = std::stoi(minutes);
+        }
+        catch (const std::exception &)
+        {
+            std::cerr << "Invalid seat count or session length at line " << lineNum << ": " << line << "\n";
+            continue;
+        }
+        if (seatCount <= 0 || sessionMinutes <= 0)
+        {
+            std::cerr << "Seat count and session length must be positive at line " << lineNum << ": " << line << "\n";
+            continue;
+        }
+        eresources.emplace_back(identifier, link, seatCount, std::chrono::minutes(sessionMinutes));
+    }
+
+    file.close();
+}
+
+std::vector<std::string> splitFields(const std::string &line, char separator = '\t')
+{
+    std::vector<std::string> fields;
+    std::string field;
+    std::istringstream iss(line);
+    while (std::getline(iss, field, separator))
+        fields.push_back(field);
+    if (!line.empty() && line.back() == separator)
+        fields.push_back("");
+    return fields;
+}
+
+// Newline-delimited messages over a Unix socket.
+class LineChannel
+{
+private:
+    int fd;
+    std::string buffer;
+
+public:
+    LineChannel(int socketFd = -1) : fd(socketFd) {}
+
+    bool readLine(std::string &line)
+    {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos)
+        {
+            char chunk[4096];
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, n);
+        }
+        line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        return true;
+    }
+
+    bool writeLine(const std::string &line)
+    {
+        std::string message = line + "\n";
+        size_t written = 0;
+        while (written < message.size())
+        {
+            ssize_t n = write(fd, message.data() + written, message.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            written += n;
+        }
+        return true;
+    }
+
+    int getFd() const
+    {
+        return fd;
+    }
+};
+
+// Maps keys to shards. Each shard owns many points on the ring, so adding a
+// shard only moves the keys that now fall just before its points.
+class ConsistentHashRing
+{
+private:
+    static const int virtualNodes = 64;
+    std::map<uint64_t, int> ring;
+
+public:
+    void addShard(int shard)
+    {
+        for (int v = 0; v < virtualNodes; ++v)
+            ring[hashString("shard-" + std::to_string(shard) + "-" + std::to_string(v))] = shard;
+    }
+
+    int shardFor(const std::string &key) const
+    {
+        if (ring.empty())
+            return -1;
+        auto it = ring.lower_bound(hashString(key));
+        if (it == ring.end())
+            it = ring.begin();
+        return it->second;
+    }
+};
+
+// One partition of the catalog and users, running in its own process.
+// Item records are "type, identifier, count, authors, title"; a count of -1
+// means the item has no copy limit. User records are "User, name, loans...".
+class ShardWorker
+{
+private:
+    std::map<std::string, std::vector<std::string>, std::less<std::string>,
+             TrackingAllocator<std::pair<const std::string, std::vector<std::string>>, CatalogRecords>> records; // This shard's catalog and users
+
+    static std::string joinFields(const std::vector<std::string> &fields, size_t first = 0)
+    {
+        std::string line;
+        for (size_t i = first; i < fields.size(); ++i)
+        {
+            if (i > first)
+                line += '\t';
+            line += fields[i];
+        }
+        return line;
+    }
+
+    static std::string keyFor(const std::vector<std::string> &record)
+    {
+        return record[0] == "User" ? "user:" + record[1] : record[1];
+    }
+
+    std::string handle(const std::vector<std::string> &request)
+    {
+        const std::string &command = request[0];
+        if ((command == "PUT" || command == "PURCHASE") && request.size() >= 3)
+        {
+            std::vector<std::string> record(request.begin() + 1, request.end());
+            std::string key = keyFor(record);
+            auto it = records.find(key);
+            // Purchases follow the menu's rules: only books, never a negative count
+            if (command == "PURCHASE" && (record[0] != "Book" || record.size() < 3))
+                return "REFUSED\tOnly books can be purchased.";
+            if (command == "PURCHASE" && std::stoi(record[2]) < 0)
+                return "REFUSED\tCount cannot be negative.";
+            if (command == "PURCHASE" && it != records.end() && it->second[0] != "Book")
+                return "REFUSED\tA magazine or journal already has this identifier.";
+            if (command == "PURCHASE" && it != records.end())
+            {
+                it->second[2] = std::to_string(std::stoi(it->second[2]) + std::stoi(record[2]));
+                return "MERGED\t" + it->second[2];
+            }
+            records[key] = record;
+            return "OK";
+        }
+        if (command == "GET" && request.size() == 2)
+        {
+            auto it = records.find(request[1]);
+            return it == records.end() ? "MISSING" : "FOUND\t" + joinFields(it->second);
+        }
+        if (command == "TAKE" && request.size() == 2)
+        {
+            auto it = records.find(request[1]);
+            if (it == records.end())
+                return "MISSING";
+            std::string reply = "FOUND\t" + joinFields(it->second);
+            records.erase(it);
+            return reply;
+        }
+        if (command == "BORROW" && request.size() == 2)
+        {
+            auto it = records.find(request[1]);
+            if (it == records.end() || it->second[0] == "User")
+                return "MISSING";
+            // Only -1 means no copy limit; any other count below 1 has nothing to lend
+            int count = std::stoi(it->second[2]);
+            if (count == -1)
+                return "OK\t" + it->second[0];
+            if (count <= 0)
+                return "UNAVAILABLE";
+            it->second[2] = std::to_string(count - 1);
+            return "OK\t" + it->second[0];
+        }
+        if (command == "RESTOCK" && request.size() == 2)
+        {
+            auto it = records.find(request[1]);
+            if (it == records.end() || it->second[0] == "User")
+                return "MISSING";
+            int count = std::stoi(it->second[2]);
+            if (count >= 0)
+                it->second[2] = std::to_string(count + 1);
+            return "OK";
+        }
+        if (command == "LOAN" && request.size() == 3)
+        {
+            std::vector<std::string> &user = records["user:" + request[1]];
+            if (user.empty())
+            {
+                user.push_back("User");
+                user.push_back(request[1]);
+            }
+            user.push_back(request[2]);
+            return "OK";
+        }
+        if (command == "KEYS")
+        {
+            std::string reply = "KEYS";
+            for (const auto &record : records)
+                reply += "\t" + record.first;
+            return reply;
+        }
+        if (command == "COUNT")
+            return "COUNT\t" + std::to_string(records.size());
+        return "ERROR\tunknown request";
+    }
+
+public:
+    void run(LineChannel &channel)
+    {
+        std::string line;
+        while (channel.readLine(line))
+        {
+            std::vector<std::string> request = splitFields(line);
+            std::string reply;
+            try
+            {
+                reply = request.empty() ? "ERROR\tempty request" : handle(request);
+            }
+            catch (const std::exception &e)
+            {
+                reply = std::string("ERROR\t") + e.what();
+            }
+            if (!channel.writeLine(reply))
+                break;
+        }
+    }
+};
+
+// Forwards catalog and user operations to worker processes over Unix sockets.
+class ShardRouter
+{
+private:
+    struct Shard
+    {
+        pid_t pid;
+        LineChannel channel;
+    };
+
+    std::vector<Shard> shards;
+    ConsistentHashRing ring;
+
+    std::string request(int shard, const std::string &line)
+    {
+        std::string reply;
+        if (!shards[shard].channel.writeLine(line) || !shards[shard].channel.readLine(reply))
+            return "ERROR\tshard " + std::to_string(shard) + " is not responding";
+        return reply;
+    }
+
+    bool spawnShard()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            std::cerr << "Failed to create shard socket: " << std::strerror(errno) << "\n";
+            return false;
+        }
+
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            std::cerr << "Failed to start shard process: " << std::strerror(errno) << "\n";
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0)
+        {
+            close(fds[0]);
+            for (const auto &shard : shards)
+                close(shard.channel.getFd());
+            // A failed request only gets an error reply; running out of budget
+            // outside a request ends the shard, and the router sees its channel close
+            try
+            {
+                LineChannel channel(fds[1]);
+                ShardWorker worker;
+                worker.run(channel);
+            }
+            catch (const MemoryBudgetExceeded &e)
+            {
+                std::cerr << "Shard " << shards.size() << ": " << e.what() << ".\n";
+                _exit(1);
+            }
+            _exit(0);
+        }
+
+        close(fds[1]);
+        Shard shard;
+        shard.pid = pid;
+        shard.channel = LineChannel(fds[0]);
+        shards.push_back(shard);
+        return true;
+    }
+
+public:
+    ShardRouter()
+    {
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    ~ShardRouter()
+    {
+        for (const auto &shard : shards)
+            close(shard.channel.getFd());
+        for (const auto &shard : shards)
+            waitpid(shard.pid, nullptr, 0);
+    }
+
+    // Starts a new shard and moves over only the keys the ring now assigns to it.
+    int addShard()
+    {
+        if (!spawnShard())
+            return 0;
+
+        int newShard = static_cast<int>(shards.size()) - 1;
+        ring.addShard(newShard);
+
+        int moved = 0;
+        for (int shard = 0; shard < newShard; ++shard)
+        {
+            std::vector<std::string> keys = splitFields(request(shard, "KEYS"));
+            for (size_t i = 1; i < keys.size(); ++i)
+            {
+                if (ring.shardFor(keys[i]) != newShard)
+                    continue;
+                std::string reply = request(shard, "TAKE\t" + keys[i]);
+                if (reply.compare(0, 6, "FOUND\t") == 0)
+                {
+                    request(newShard, "PUT\t" + reply.substr(6));
+                    ++moved;
+                }
+            }
+        }
+        return moved;
+    }
+
+    // Streams the catalog files to the shards one record at a time, so the
+    // router never holds the catalog and each worker holds only its partition.
+    void loadCatalog(const std::string &booksFile, const std::string &magazinesFile, const std::string &journalsFile)
+    {
+        std::ifstream books(booksFile);
+        if (!books.is_open())
+            std::cerr << "Failed to open file: " << booksFile << "\n";
+
+        // A shard that cannot store a record (for example, over its memory budget) replies with an error
+        size_t failed = 0;
+        std::string firstError;
+        auto store = [&](const std::string &record) {
+            std::string reply = put(record);
+            if (reply.compare(0, 6, "ERROR\t") == 0 && failed++ == 0)
+                firstError = reply.substr(6);
+        };
+
+        std::string line;
+        int lineNum = 0;
+        while (std::getline(books, line))
+        {
+            ++lineNum;
+
+            int count;
+            std::string isbn, authors, title;
+            if (parseBookLine(line, lineNum, count, isbn, authors, title))
+                store("Book\t" + isbn + "\t" + std::to_string(count) + "\t" + authors + "\t" + title);
+        }
+
+        const std::pair<std::string, std::string> nameFiles[] = {std::make_pair(std::string("Magazine"), magazinesFile),
+                                                                std::make_pair(std::string("Journal"), journalsFile)};
+        for (const auto &nameFile : nameFiles)
+        {
+            std::ifstream file(nameFile.second);
+            if (!file.is_open())
+            {
+                std::cerr << "Failed to open file: " << nameFile.second << "\n";
+                continue;
+            }
+            while (std::getline(file, line))
+                store(nameFile.first + "\t" + line + "\t-1\t\t" + line);
+        }
+
+        if (failed > 0)
+            std::cerr << failed << " catalog records were not stored: " << firstError << "\n";
+    }
+
+    std::string put(const std::string &record)
+    {
+        return request(ring.shardFor(splitFields(record)[1]), "PUT\t" + record);
+    }
+
+    std::string lookup(const std::string &itemIdentifier)
+    {
+        return request(ring.shardFor(itemIdentifier), "GET\t" + itemIdentifier);
+    }
+
+    std::string purchase(const Book &book)
+    {
+        return request(ring.shardFor(book.getIdentifier()), "PURCHASE\tBook\t" + book.getIdentifier() + "\t" +
+                                                               std::to_string(book.getCount()) + "\t" + book.getAuthors() + "\t" + book.getTitle());
+    }
+
+    // Takes a copy from the item's shard, then records the loan on the user's shard.
+    // The copy is put back if the loan cannot be recorded.
+    std::string borrow(const std::string &username, const std::string &itemIdentifier)
+    {
+        int itemShard = ring.shardFor(itemIdentifier);
+        std::string reply = request(itemShard, "BORROW\t" + itemIdentifier);
+        if (reply.compare(0, 3, "OK\t") != 0)
+            return reply;
+
+        reply = request(ring.shardFor("user:" + username), "LOAN\t" + username + "\t" + itemIdentifier);
+        if (reply != "OK")
+            request(itemShard, "RESTOCK\t" + itemIdentifier);
+        return reply;
+    }
+
+    std::string loans(const std::string &username)
+    {
+        return request(ring.shardFor("user:" + username), "GET\tuser:" + username);
+    }
+
+    void displayShards()
+    {
+        for (size_t shard = 0; shard < shards.size(); ++shard)
+        {
+            std::vector<std::string> reply = splitFields(request(shard, "COUNT"));
+            std::cout << "Shard " << shard << " (pid " << shards[shard].pid << "): "
+                      << (reply.size() == 2 ? reply[1] : "?") << " records\n";
+        }
+    }
+};
+
+struct LoanOperation
+{
+    bool isReturn;
+    std::string username;
+    std::string itemIdentifier;
+};
+
+// Carries the first exception thrown on any of a group of threads back to
+// the thread that joins them, instead of letting it terminate the program.
+class ThreadFailure
+{
+private:
+    std::mutex lock;
+    std::exception_ptr first;
+    std::atomic<bool> anyFailed;
+
+public:
+    ThreadFailure() : anyFailed(false) {}
+
+    // Runs body, keeping its exception if it is the first one.
+    template <typename Body>
+    void guard(Body body)
+    {
+        try
+        {
+            body();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!first)
+                first = std::current_exception();
+            anyFailed = true;
+        }
+    }
+
+    bool failed() const
+    {
+        return anyFailed.load();
+    }
+
+    // Call after every thread has been joined.
+    void rethrow()
+    {
+        if (first)
+            std::rethrow_exception(first);
+    }
+};
+
+// Runs batches of borrows and returns on a work-stealing thread pool.
+// All operations of one user form a single task and run in file order, and
+// copies are taken with an atomic compare-and-swap, so the outcome matches a
+// sequential run of the batch with each user's operations kept in order.
+class LoanExecutor
+{
+private:
+    const CatalogIndex &index; // Finds the item; magazines and journals have no copy limit and no stock
+    std::deque<std::atomic<int>, TrackingAllocator<std::atomic<int>, LoanStock>> stock; // Copies left per book position, -1 means no copy limit
+
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+
+    // Sets taken to the number of copies removed from the count: 1, or 0 for
+    // an item with no copy limit. The caller reports it with the loan.
+    bool takeCopy(size_t item, int &taken)
+    {
+        int copies = stock[item].load();
+        while (copies != 0)
+        {
+            taken = copies < 0 ? 0 : 1;
+            if (copies < 0 || stock[item].compare_exchange_weak(copies, copies - 1))
+                return true;
+        }
+        return false;
+    }
+
+    // Returns the number of copies added to the count, for the caller to report.
+    int putCopyBack(size_t item)
+    {
+        int copies = stock[item].load();
+        while (copies >= 0 && !stock[item].compare_exchange_weak(copies, copies + 1))
+        {
+        }
+        return copies >= 0 ? 1 : 0;
+    }
+
+    LoanResult apply(const LoanOperation &operation, User &user)
+    {
+        ItemType type;
+        size_t position;
+        if (!index.findItem(operation.itemIdentifier, type, position))
+            return LoanResult::ItemNotFound;
+
+        // Only loans of the catalog type took a copy from this stock; an item
+        // on loan (LoanableItemType) with the same identifier did not
+        StockChange change = {position, 0};
+        if (operation.isReturn)
+        {
+            if (!user.hasBorrowed(operation.itemIdentifier, type))
+                return LoanResult::NotBorrowed;
+            if (type == BookItem)
+                change.copies = putCopyBack(position);
+            user.returnItem(operation.itemIdentifier, change);
+            return LoanResult::Done;
+        }
+
+        // Borrowing an item again only renews the loan, so it takes no copy
+        if (user.hasBorrowed(operation.itemIdentifier))
+            return user.borrowItem(operation.itemIdentifier, type);
+        if (!user.canBorrow(type))
+            return LoanResult::LimitReached;
+        if (type == BookItem && !takeCopy(position, change.copies))
+            return LoanResult::NoCopiesLeft;
+        user.borrowItem(operation.itemIdentifier, type, change);
+        return LoanResult::Done;
+    }
+
+    static bool nextTask(std::vector<WorkQueue> &queues, size_t self, size_t &task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queues[self].lock);
+            if (!queues[self].tasks.empty())
+            {
+                task = queues[self].tasks.back();
+                queues[self].tasks.pop_back();
+                return true;
+            }
+        }
+
+        // Own queue is empty: steal the oldest task from another worker
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            WorkQueue &victim = queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    LoanExecutor(const CatalogIndex &catalogIndex, const BookList &books) : index(catalogIndex), stock(books.size())
+    {
+        for (size_t i = 0; i < books.size(); ++i)
+            stock[i] = books[i].getCount();
+    }
+
+    // Adds copies of the book at a catalog position; a position past the known
+    // books is a newly purchased one. Must not be called while a batch is running.
+    void addStock(size_t book, int copies)
+    {
+        while (stock.size() <= book)
+            stock.emplace_back(0);
+        if (stock[book] >= 0)
+            stock[book] += copies;
+    }
+
+    // Runs one operation on the calling thread. The menu borrows through this so
+    // that menu and batch loans draw on the same stock.
+    LoanResult runOne(const LoanOperation &operation, User &user)
+    {
+        return apply(operation, user);
+    }
+
+    bool findItemType(const std::string &itemIdentifier, ItemType &type) const
+    {
+        size_t position;
+        return index.findItem(itemIdentifier, type, position);
+    }
+
+    // Every user named in the batch must already be in users.
+    std::vector<LoanResult> run(const std::vector<LoanOperation> &batch, std::map<std::string, User *> &users,
+                                unsigned threadCount = std::thread::hardware_concurrency())
+    {
+        std::vector<LoanResult> results(batch.size(), LoanResult::Done);
+
+        std::map<std::string, size_t> taskOfUser;
+        std::vector<std::vector<size_t>> tasks;
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            auto inserted = taskOfUser.insert(std::make_pair(batch[i].username, tasks.size()));
+            if (inserted.second)
+                tasks.push_back(std::vector<size_t>());
+            tasks[inserted.first->second].push_back(i);
+        }
+
+        if (threadCount == 0)
+            threadCount = 1;
+        threadCount = std::min<size_t>(threadCount, std::max<size_t>(tasks.size(), 1));
+
+        std::vector<WorkQueue> queues(threadCount);
+        for (size_t t = 0; t < tasks.size(); ++t)
+            queues[t % threadCount].tasks.push_back(t);
+
+        // The first exception stops every worker and is rethrown here once they have all finished
+        ThreadFailure failure;
+        auto worker = [&](size_t self) {
+            failure.guard([&] {
+                size_t task;
+                while (!failure.failed() && nextTask(queues, self, task))
+                {
+                    for (size_t index : tasks[task])
+                    {
+                        const LoanOperation &operation = batch[index];
+                        results[index] = apply(operation, *users.at(operation.username));
+                    }
+                }
+            });
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < threadCount; ++t)
+            threads.push_back(std::thread(worker, t));
+        worker(0);
+        for (auto &thread : threads)
+            thread.join();
+        failure.rethrow();
+
+        return results;
+    }
+};
+
+// Reads "borrow,username,identifier" or "return,username,identifier" lines.
+std::vector<LoanOperation> readLoanBatch(const std::string &filename)
+{
+    std::vector<LoanOperation> batch;
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return batch;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNum;
+        std::vector<std::string> fields = splitFields(line, ',');
+        if (fields.size() != 3 || (fields[0] != "borrow" && fields[0] != "return"))
+        {
+            std::cerr << "Invalid line format at line " << lineNum << "\n";
+            continue;
+        }
+
+        LoanOperation operation;
+        operation.isReturn = fields[0] == "return";
+        operation.username = fields[1];
+        operation.itemIdentifier = fields[2];
+        batch.push_back(operation);
+    }
+
+    file.close();
+    return batch;
+}
+
+// One menu operation: the menu choice ("*" for input read before the menu)
+// and every field typed for it, with its offset from the start of the session.
+struct TraceOperation
+{
+    long long offsetMicros;
+    std::string choice;
+    std::vector<std::string> fields;
+};
+
+// Wraps the menu's input stream. While recording, every operation is written
+// to a trace file as "offset<TAB>choice<TAB>field...". While replaying, it
+// times each operation and can pace them to their recorded offsets.
+class MenuInput
+{
+private:
+    std::istream &in;
+    std::chrono::steady_clock::time_point sessionStart;
+    TraceOperation current;
+
+    std::ofstream trace;
+    bool recording;
+
+    const std::vector<TraceOperation> *replayOperations;
+    bool paced;
+    size_t nextOperation;
+    std::chrono::steady_clock::time_point operationStart;
+    std::vector<long long> latencies;
+
+    long long elapsedMicros() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sessionStart).count();
+    }
+
+    void endOperation()
+    {
+        if (recording)
+        {
+            trace << current.offsetMicros << '\t' << current.choice;
+            for (const auto &field : current.fields)
+                trace << '\t' << field;
+            trace << '\n';
+        }
+
+        if (replayOperations && nextOperation > 0)
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - operationStart).count());
+    }
+
+    void beginOperation(const std::string &choice)
+    {
+        if (replayOperations && nextOperation < replayOperations->size())
+        {
+            if (paced)
+                std::this_thread::sleep_until(sessionStart + std::chrono::microseconds((*replayOperations)[nextOperation].offsetMicros));
+            ++nextOperation;
+        }
+
+        current.offsetMicros = elapsedMicros();
+        current.choice = choice;
+        current.fields.clear();
+        operationStart = std::chrono::steady_clock::now();
+    }
+
+public:
+    MenuInput(std::istream &input)
+        : in(input), sessionStart(std::chrono::steady_clock::now()), recording(false), replayOperations(nullptr), paced(false), nextOperation(0)
+    {
+        beginOperation("*");
+    }
+
+    // Replays operations read from input; the stream must hold their text.
+    MenuInput(std::istream &input, const std::vector<TraceOperation> &operations, bool pacedReplay)
+        : in(input), sessionStart(std::chrono::steady_clock::now()), recording(false), replayOperations(&operations), paced(pacedReplay), nextOperation(0)
+    {
+        beginOperation("*");
+    }
+
+    bool startRecording(const std::string &filename)
+    {
+        trace.open(filename);
+        if (!trace.is_open())
+        {
+            std::cerr << "Failed to open trace file: " << filename << "\n";
+            return false;
+        }
+        recording = true;
+        return true;
+    }
+
+    // Reads the next menu choice. At end of input it returns exitChoice, and
+    // anything that is not a number gives 0. The text is recorded as typed.
+    int readChoice(int exitChoice)
+    {
+        endOperation();
+
+        std::string token;
+        if (!(in >> token))
+        {
+            beginOperation(std::to_string(exitChoice));
+            return exitChoice;
+        }
+
+        char *end = nullptr;
+        long value = std::strtol(token.c_str(), &end, 10);
+        int choice = *end == '\0' && value > 0 && value <= INT_MAX ? static_cast<int>(value) : 0;
+        beginOperation(token);
+        return choice;
+    }
+
+    // Records the end of the last operation and flushes the trace.
+    void finish()
+    {
+        endOperation();
+        replayOperations = nullptr;
+        if (recording)
+            trace.flush();
+    }
+
+    MenuInput &operator>>(std::string &value)
+    {
+        in >> value;
+        current.fields.push_back(value);
+        return *this;
+    }
+
+    MenuInput &operator>>(int &value)
+    {
+        in >> value;
+        current.fields.push_back(std::to_string(value));
+        return *this;
+    }
+
+    void getline(std::string &value)
+    {
+        std::getline(in, value);
+        current.fields.push_back(value);
+    }
+
+    void ignore(std::streamsize count = 1, int delimiter = EOF)
+    {
+        in.ignore(count, delimiter);
+    }
+
+    void clear()
+    {
+        in.clear();
+    }
+
+    const std::vector<long long> &getLatencies() const
+    {
+        return latencies;
+    }
+};
+
+// Output sink for replay sessions.
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override
+    {
+        return c;
+    }
+};
+
+std::vector<TraceOperation> readTrace(const std::string &filename)
+{
+    std::vector<TraceOperation> operations;
+    std::ifstream file(filename);
+    if (!file.is_open())
+    {
+        std::cerr << "Failed to open file: " << filename << "\n";
+        return operations;
+    }
+
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(file, line))
+    {
+        ++lineNum;
+        std::vector<std::string> fields = splitFields(line);
+        if (fields.size() < 2)
+        {
+            std::cerr << "Invalid line format at line " << lineNum << "\n";
+            continue;
+        }
+
+        TraceOperation operation;
+        operation.offsetMicros = std::atoll(fields[0].c_str());
+        operation.choice = fields[1];
+        operation.fields.assign(fields.begin() + 2, fields.end());
+        operations.push_back(operation);
+    }
+
+    file.close();
+    return operations;
+}
+
+// Turns operations back into the text a user would have typed.
+std::string traceInput(const std::vector<TraceOperation> &operations)
+{
+    std::string input;
+    for (const auto &operation : operations)
+    {
+        if (operation.choice != "*")
+            input += operation.choice + "\n";
+        for (const auto &field : operation.fields)
+            input += field + "\n";
+    }
+    return input;
+}
+
+void reportReplay(size_t sessions, std::vector<long long> &latencies, std::chrono::steady_clock::duration wallTime)
+{
+    std::sort(latencies.begin(), latencies.end());
+    double seconds = std::chrono::duration<double>(wallTime).count();
+
+    std::cout << "Replayed " << latencies.size() << " operations in " << sessions << " sessions in " << seconds << " s ("
+              << (seconds > 0 ? latencies.size() / seconds : 0) << " operations per second)\n";
+    if (latencies.empty())
+        return;
+
+    const double percentiles[] = {50, 90, 99, 99.9};
+    for (double p : percentiles)
+    {
+        size_t rank = std::min(latencies.size() - 1, static_cast<size_t>(p / 100 * latencies.size()));
+        std::cout << "  p" << p << ": " << latencies[rank] / 1000.0 << " us\n";
+    }
+    std::cout << "  max: " << latencies.back() / 1000.0 << " us\n";
+}
 
 class BookStore
 {
-public:
-    void purchaseNewBook(std::vector<Book> &books)
+public:
+    Book readNewBook(MenuInput &in, std::ostream &out = std::cout)
+    {
+        std::string isbn, authors, title, location, returnDuration;
+        int count;
+
+        out << "Enter ISBN: ";
+        in >> isbn;
+
+        out << "Enter authors: ";
+        in.ignore();
+        in.getline(authors);
+
+        out << "Enter title: ";
+        in.getline(title);
+
+        out << "Enter location: ";
+        in.getline(location);
+
+        out << "Enter return duration: ";
+        in.getline(returnDuration);
+
+        out << "Enter count: ";
+        in >> count;
+
+        return Book(isbn, location, returnDuration, count, isbn, authors, title);
+    }
+
+    void purchaseNewBook(MenuInput &in, std::ostream &out, BookList &books, CatalogIndex &index, LoanExecutor &executor)
+    {
+        Book newBook = readNewBook(in, out);
+        if (newBook.getCount() < 0)
+        {
+            out << "Count cannot be negative.\n";
+            return;
+        }
+        if (index.isMagazineOrJournal(newBook.getIdentifier()))
+        {
+            out << "A magazine or journal already has this identifier.\n";
+            return;
+        }
+
+        long position = index.findBook(newBook.getIdentifier());
+        if (position >= 0)
+        {
+            executor.addStock(position, newBook.getCount());
+            index.addCopies(books, position, newBook.getCount());
+            out << "Book already in the library, copies added.\n";
+            return;
+        }
+
+        books.push_back(newBook);
+        index.addBook(books.size() - 1);
+        index.addBookDetails(books.back(), books.size() - 1);
+        executor.addStock(books.size() - 1, newBook.getCount());
+
+        out << "Book purchased and added to the library.\n";
+    }
+
+    // Streams a purchase order in the books.csv format. Repeated ISBNs, in the
+    // catalog or within the file, only add to the count of the existing record;
+    // new titles are collected and appended to the catalog in one step.
+    void importPurchaseOrder(const std::string &filename, BookList &books, CatalogIndex &index, LoanExecutor &executor, std::ostream &out = std::cout)
+    {
+        std::ifstream file(filename);
+        if (!file.is_open())
+        {
+            std::cerr << "Failed to open file: " << filename << "\n";
+            return;
+        }
+
+        BookList newBooks;
+        std::unordered_map<std::string, size_t> newPositions; // Titles new in this order, which the index only sees once appended
+        size_t firstNew = books.size();
+        int merged = 0;
+
+        std::string line;
+        int lineNum = 0;
+        while (std::getline(file, line))
+        {
+            ++lineNum;
+
+            int count;
+            std::string isbn, authors, title;
+            if (!parseBookLine(line, lineNum, count, isbn, authors, title))
+                continue;
+            if (count < 0)
+            {
+                std::cerr << "Negative count at line " << lineNum << ": " << count << "\n";
+                continue;
+            }
+            if (index.isMagazineOrJournal(isbn))
+            {
+                std::cerr << "Identifier of a magazine or journal at line " << lineNum << ": " << isbn << "\n";
+                continue;
+            }
+
+            long position = index.findBook(isbn);
+            auto pending = newPositions.find(isbn);
+            if (position >= 0)
+            {
+                executor.addStock(position, count);
+                index.addCopies(books, position, count);
+                ++merged;
+            }
+            else if (pending != newPositions.end())
+            {
+                newBooks[pending->second].addCopies(count);
+                ++merged;
+            }
+            else
+            {
+                newPositions[isbn] = newBooks.size();
+                newBooks.emplace_back(isbn, "Unknown location", "Unknown duration", count, isbn, authors, title);
+            }
+        }
+        file.close();
+
+        books.reserve(firstNew + newBooks.size());
+        books.insert(books.end(), std::make_move_iterator(newBooks.begin()), std::make_move_iterator(newBooks.end()));
+        for (size_t position = firstNew; position < books.size(); ++position)
+        {
+            index.addBook(position);
+            index.addBookDetails(books[position], position);
+            executor.addStock(position, books[position].getCount());
+        }
+
+        out << "Purchase order imported: " << newBooks.size() << " new titles, " << merged << " merged into existing records.\n";
+    }
+};
+
+// Prints a shard reply as the regular menu would. Item records are
+// "FOUND, type, identifier, count, authors, title".
+void printShardReply(const std::string &reply)
+{
+    std::vector<std::string> fields = splitFields(reply);
+    if (reply == "MISSING")
+        std::cout << "Item not found.\n";
+    else if (reply == "UNAVAILABLE")
+        std::cout << "No copies left to borrow.\n";
+    else if (fields.size() == 2 && fields[0] == "REFUSED")
+        std::cout << fields[1] << "\n";
+    else if (!fields.empty() && fields[0] == "ERROR")
+        std::cout << "Shard error: " << (fields.size() > 1 ? fields[1] : "unknown") << "\n";
+    else if (fields.size() == 6 && fields[0] == "FOUND")
     {
-        std::string isbn, authors, title, location, returnDuration;
-        int count;
+        std::cout << "Type: " << fields[1] << ", Identifier: " << fields[2];
+        if (fields[3] != "-1")
+            std::cout << ", Count: " << fields[3];
+        if (fields[1] == "Book")
+            std::cout << ", Authors: " << fields[4];
+        std::cout << ", Title: " << fields[5] << "\n";
+    }
+    else
+        std::cout << "Unexpected shard reply.\n";
+}
+
+void runShardedMode(int shardCount)
+{
+    ShardRouter router;
+    for (int i = 0; i < shardCount; ++i)
+        router.addShard();
+    router.loadCatalog("books.csv", "magazines.csv", "journals.csv");
+
+    BookStore bookStore;
+    MenuInput input(std::cin);
+    std::string username = "Ajay";
+
+    int choice;
+    do
+    {
+        std::cout << "Sharded Menu:\n";
+        std::cout << "1. Look up an item\n";
+        std::cout << "2. Borrow an item\n";
+        std::cout << "3. Display borrowed items\n";
+        std::cout << "4. Purchase a new book\n";
+        std::cout << "5. Add a shard\n";
+        std::cout << "6. Display shards\n";
+        std::cout << "7. Exit\n";
+        std::cout << "Enter your choice: ";
+        choice = input.readChoice(7);
 
-        std::cout << "Enter ISBN: ";
-        std::cin >> isbn;
+        switch (choice)
+        {
+        case 1:
+        case 2:
+        {
+            std::string itemIdentifier;
+            input.ignore();
+            std::cout << "Enter the item identifier: ";
+            input.getline(itemIdentifier);
 
-        std::cout << "Enter authors: ";
-        std::cin.ignore();
-        std::getline(std::cin, authors);
+            std::string reply = choice == 1 ? router.lookup(itemIdentifier) : router.borrow(username, itemIdentifier);
+            if (choice == 2 && reply == "OK")
+                std::cout << "Successfully borrowed the item.\n";
+            else
+                printShardReply(reply);
+        }
+        break;
 
-        std::cout << "Enter title: ";
-        std::getline(std::cin, title);
+        case 3:
+        {
+            // The user record is "FOUND, User, name, identifier..."
+            std::vector<std::string> fields = splitFields(router.loans(username));
+            std::cout << "Borrowed Items for User " << username << ":\n";
+            for (size_t i = 3; i < fields.size() && fields[0] == "FOUND"; ++i)
+                std::cout << "Item Identifier: " << fields[i] << "\n";
+        }
+        break;
 
-        std::cout << "Enter location: ";
-        std::getline(std::cin, location);
+        case 4:
+        {
+            Book newBook = bookStore.readNewBook(input);
+            if (newBook.getCount() < 0)
+            {
+                std::cout << "Count cannot be negative.\n";
+                break;
+            }
 
-        std::cout << "Enter return duration: ";
-        std::getline(std::cin, returnDuration);
+            std::string reply = router.purchase(newBook);
+            if (reply == "OK")
+                std::cout << "Book purchased and added to the library.\n";
+            else if (reply.compare(0, 7, "MERGED\t") == 0)
+                std::cout << "Book already in the library, copies added. Copies now: " << reply.substr(7) << "\n";
+            else
+                printShardReply(reply);
+        }
+        break;
 
-        std::cout << "Enter count: ";
-        std::cin >> count;
+        case 5:
+            std::cout << "Shard added, " << router.addShard() << " records moved.\n";
+            break;
 
-        Book newBook(isbn, location, returnDuration, count, isbn, authors, title);
-        books.push_back(newBook);
+        case 6:
+            router.displayShards();
+            break;
 
-        std::cout << "Book purchased and added to the library.\n";
-    }
-};
+        case 7:
+            std::cout << "Exiting the program. Goodbye!\n";
+            break;
+
+        default:
+            std::cout << "Invalid choice. Try again.\n";
+            input.clear();
+            input.ignore(INT_MAX, '\n');
+        }
+    } while (choice != 7);
+}
 
-int main()
+// Asks how to browse the catalog, then prints it one page at a time.
+void browseCatalog(MenuInput &in, std::ostream &out, CatalogIndex &index, const BookList &books,
+                   const MagazineList &magazines, const JournalList &journals)
 {
-    std::vector<Book> books;
-    readBooksCSV("books.csv", books);
+    const size_t pageSize = 10;
+
+    int mode;
+    out << "Browse by: 1. Author prefix 2. Title prefix 3. Count range 4. Item type\n";
+    out << "Enter your choice: ";
+    in >> mode;
+
+    std::string text;
+    int minCount = 0, maxCount = 0, type = 0;
+    if (mode == 1 || mode == 2)
+    {
+        in.ignore();
+        out << "Enter prefix: ";
+        in.getline(text);
+    }
+    else if (mode == 3)
+    {
+        out << "Enter lowest count: ";
+        in >> minCount;
+        out << "Enter highest count: ";
+        in >> maxCount;
+    }
+    else if (mode == 4)
+    {
+        out << "Enter item type (1 for books, 2 for magazines, 3 for journals): ";
+        in >> type;
+        if (type < 1 || type > 3)
+        {
+            out << "Invalid item type.\n";
+            return;
+        }
+    }
+    else
+    {
+        out << "Invalid choice.\n";
+        return;
+    }
+
+    if (mode != 4 || type == 1)
+        index.indexBooks();
+
+    PageCursor<IndexString> textCursor;
+    PageCursor<int> countCursor;
+    for (int pageNumber = 1;; ++pageNumber)
+    {
+        std::vector<size_t> positions;
+        if (mode == 1)
+            positions = index.booksByAuthorPrefix(text, pageSize, textCursor);
+        else if (mode == 2)
+            positions = index.booksByTitlePrefix(text, pageSize, textCursor);
+        else if (mode == 3)
+            positions = index.booksByCountRange(minCount, maxCount, pageSize, countCursor);
+        else
+            positions = index.itemsOfType(static_cast<ItemType>(type - 1), pageSize, textCursor);
+
+        out << "Page " << pageNumber << ":\n";
+        for (size_t position : positions)
+        {
+            if (mode == 4 && type == 2)
+                magazines[position].displayInfo(out);
+            else if (mode == 4 && type == 3)
+                journals[position].displayInfo(out);
+            else
+                books[position].displayInfo(out);
+        }
+
+        if (positions.empty() || textCursor.finished || countCursor.finished)
+        {
+            out << "End of results.\n";
+            return;
+        }
+
+        std::string answer;
+        out << "Show next page? (y/n): ";
+        in >> answer;
+        if (answer != "y")
+            return;
+    }
+}
 
-    std::vector<Magazine> magazines;
-    readMagazinesCSV("magazines.csv", magazines);
+// Runs one library session: reads menu choices from in until the user exits.
+// Electronic items are shared by reference: their seats are licensed across all sessions.
+void runMenu(MenuInput &in, std::ostream &out, BookList books, MagazineList magazines, JournalList journals,
+             std::vector<ElectronicItem> &eresources, const LoanPolicyTable &loanPolicies)
+{
+    std::map<std::string, LoanableItem> loanableItems;
 
-    std::vector<Journal> journals;
-    readJournalsCSV("journals.csv", journals);
+    LoanAnalytics analytics;
 
     User user("Ajay");
+    user.setAnalytics(&analytics);
+    user.setLoanPolicies(&loanPolicies);
+
+    CatalogIndex catalogIndex(books, magazines, journals);
+    LoanExecutor loanExecutor(catalogIndex, books);
+    std::map<std::string, User> batchUsers;
+
+    ReportSnapshots reports;
+    user.setReports(&reports);
+
+    // The session user, or the registered/batch user of that name created on first use.
+    auto userNamed = [&](const std::string &username) -> User & {
+        if (username == user.getUsername())
+            return user;
+        auto it = batchUsers.find(username);
+        if (it == batchUsers.end())
+        {
+            it = batchUsers.insert(std::make_pair(username, User(username))).first;
+            it->second.setAnalytics(&analytics);
+            it->second.setLoanPolicies(&loanPolicies);
+            it->second.setReports(&reports);
+        }
+        return it->second;
+    };
+
+    std::unordered_map<std::string, size_t> eresourceIndex;
+    for (size_t i = 0; i < eresources.size(); ++i)
+        eresourceIndex[eresources[i].getIdentifier()] = i;
+    std::map<std::string, SeatLease> openSessions;
 
     BookStore bookStore;
 
     int choice;
     do
     {
-        std::cout << "Menu:\n";
-        std::cout << "1. Borrow a regular item\n";
-        std::cout << "2. Borrow an item on loan\n";
-        std::cout << "3. Display borrowed items\n";
-        std::cout << "4. Register a new user\n";
-        std::cout << "5. Purchase a new book\n";
-        std::cout << "6. Exit\n";
-        std::cout << "Enter your choice: ";
-        std::cin >> choice;
+        out << "Menu:\n";
+        out << "1. Borrow a regular item\n";
+        out << "2. Borrow an item on loan\n";
+        out << "3. Display borrowed items\n";
+        out << "4. Register a new user\n";
+        out << "5. Purchase a new book\n";
+        out << "6. Return an item on loan\n";
+        out << "7. Show loan statistics\n";
+        out << "8. Process a loan batch file\n";
+        out << "9. Import a purchase order file\n";
+        out << "10. Open an electronic resource\n";
+        out << "11. Close an electronic resource\n";
+        out << "12. Browse the catalog\n";
+        out << "13. Inventory report\n";
+        out << "14. Borrowed items report for all users\n";
+        out << "15. Memory usage report\n";
+        out << "16. Exit\n";
+        out << "Enter your choice: ";
+        choice = in.readChoice(16);
 
         switch (choice)
         {
         case 1:
         {
             std::string itemIdentifier;
-            std::cin.ignore();
-            std::cout << "Enter the item identifier to borrow: ";
-            std::getline(std::cin, itemIdentifier);
+            in.ignore();
+            out << "Enter the item identifier to borrow: ";
+            in.getline(itemIdentifier);
 
-            bool itemFound = false;
-            for (const auto &book : books)
+            if (!catalogIndex.mightContain(itemIdentifier))
             {
-                if (book.getIdentifier() == itemIdentifier)
-                {
-                    user.borrowItem(book.getIdentifier());
-                    std::cout << "Successfully borrowed a book.\n";
-                    itemFound = true;
-                    break;
-                }
+                out << "Item not found.\n";
+                break;
             }
 
-            for (const auto &magazine : magazines)
+            LoanOperation operation = {false, user.getUsername(), itemIdentifier};
+            bool renewal = user.hasBorrowed(itemIdentifier);
+            LoanResult result = loanExecutor.runOne(operation, user);
+            ItemType type = BookItem;
+            loanExecutor.findItemType(itemIdentifier, type);
+            if (result == LoanResult::Done && renewal)
+                out << "Loan renewed.\n";
+            else if (result == LoanResult::Done)
+                out << "Successfully borrowed a " << (type == BookItem ? "book" : type == MagazineItem ? "magazine" : "journal") << ".\n";
+            else if (result == LoanResult::NoCopiesLeft)
+                out << "No copies left to borrow.\n";
+            else if (result == LoanResult::LimitReached)
+                out << "Loan limit reached for this item type.\n";
+            else if (result == LoanResult::RenewalLimitReached)
+                out << "This loan cannot be renewed again.\n";
+            else if (result == LoanResult::HeldAsOtherType)
+                out << "You already have this item as an item on loan.\n";
+            else
+                out << "Item not found.\n";
+        }
+        break;
+
+        case 2:
+        {
+            std::string username, itemIdentifier;
+            in.ignore();
+            out << "Enter username: ";
+            in.getline(username);
+            out << "Enter the item identifier to borrow on loan: ";
+            in.getline(itemIdentifier);
+            User &borrower = userNamed(username);
+
+            if (!catalogContains(itemIdentifier, catalogIndex, magazines, journals))
             {
-                if (magazine.getIdentifier() == itemIdentifier)
-                {
-                    user.borrowItem(magazine.getIdentifier());
-                    std::cout << "Successfully borrowed a magazine.\n";
-                    itemFound = true;
-                    break;
-                }
+                out << "Item not found.\n";
+                break;
             }
 
-            for (const auto &journal : journals)
+            auto it = loanableItems.find(itemIdentifier);
+            if (it == loanableItems.end())
+                it = loanableItems.emplace(itemIdentifier, LoanableItem(itemIdentifier, "Unknown location", "7 days")).first;
+
+            if (it->second.canBeBorrowed() && borrower.hasBorrowed(itemIdentifier))
+                out << "You already have this item as a regular loan.\n";
+            else if (it->second.canBeBorrowed() && !borrower.canBorrow(LoanableItemType))
+                out << "Loan limit reached for this item type.\n";
+            else if (it->second.canBeBorrowed())
             {
-                if (journal.getIdentifier() == itemIdentifier)
+                it->second.borrow(username, borrower.loanPolicy(LoanableItemType).loanPeriod);
+                borrower.borrowItem(itemIdentifier, LoanableItemType);
+                out << "Successfully borrowed the item on loan.\n";
+            }
+            else
+            {
+                size_t position = it->second.placeHold(username);
+                if (position == 0)
+                    out << "You already have this item on loan or on hold.\n";
+                else
+                    out << "Item is already on loan. Hold placed, position in queue: " << position << "\n";
+            }
+        }
+        break;
+
+        case 3:
+            user.displayBorrowedItems(books, magazines, journals, out, &catalogIndex.getFilter());
+            break;
+
+        case 4:
+        {
+            std::string username;
+            out << "Enter username: ";
+            in.ignore();
+            in.getline(username);
+
+            userNamed(username);
+
+            out << "User registered successfully.\n";
+        }
+        break;
+
+        case 5:
+            bookStore.purchaseNewBook(in, out, books, catalogIndex, loanExecutor);
+            break;
+
+        case 6:
+        {
+            std::string username, itemIdentifier;
+            in.ignore();
+            out << "Enter username: ";
+            in.getline(username);
+            out << "Enter the item identifier to return: ";
+            in.getline(itemIdentifier);
+
+            auto it = loanableItems.find(itemIdentifier);
+            if (it == loanableItems.end() || it->second.getBorrower() != username)
+            {
+                out << "You do not have this item on loan.\n";
+                break;
+            }
+
+            userNamed(username).returnItem(itemIdentifier);
+
+            // The item goes to the first holder whose User record accepts the loan
+            std::string nextUser = it->second.returnItem([&](const std::string &holderName, std::chrono::hours &period) {
+                User &holder = userNamed(holderName);
+                if (!holder.hasBorrowed(itemIdentifier) && holder.borrowItem(itemIdentifier, LoanableItemType) == LoanResult::Done)
                 {
-                    user.borrowItem(journal.getIdentifier());
-                    std::cout << "Successfully borrowed a journal.\n";
-                    itemFound = true;
-                    break;
+                    period = holder.loanPolicy(LoanableItemType).loanPeriod;
+                    return true;
                 }
+                out << holderName << " cannot take the item, hold skipped.\n";
+                return false;
+            });
+
+            if (nextUser.empty())
+                out << "Item returned.\n";
+            else
+                out << "Item returned and handed to " << nextUser << " from the hold queue.\n";
+        }
+        break;
+
+        case 7:
+            analytics.displayStatistics(out);
+            break;
+
+        case 8:
+        {
+            std::string filename;
+            in.ignore();
+            out << "Enter the batch file name: ";
+            in.getline(filename);
+
+            std::vector<LoanOperation> batch = readLoanBatch(filename);
+            std::map<std::string, User *> users;
+            users[user.getUsername()] = &user;
+            for (const auto &operation : batch)
+            {
+                if (!users.count(operation.username))
+                    users[operation.username] = &userNamed(operation.username);
             }
 
-            if (!itemFound)
+            std::vector<LoanResult> results = loanExecutor.run(batch, users);
+
+            int done = 0, failed = 0;
+            for (size_t i = 0; i < results.size(); ++i)
             {
-                std::cout << "Item not found.\n";
+                if (results[i] == LoanResult::Done)
+                {
+                    ++done;
+                    continue;
+                }
+                ++failed;
+                out << (batch[i].isReturn ? "Return" : "Borrow") << " of " << batch[i].itemIdentifier << " by " << batch[i].username << " failed: "
+                    << loanResultText(results[i]) << "\n";
             }
+            out << "Processed " << results.size() << " operations: " << done << " done, " << failed << " failed.\n";
         }
         break;
 
-        case 2:
+        case 9:
         {
-            std::string itemIdentifier;
-            std::cin.ignore();
-            std::cout << "Enter the item identifier to borrow on loan: ";
-            std::getline(std::cin, itemIdentifier);
+            std::string filename;
+            in.ignore();
+            out << "Enter the purchase order file name: ";
+            in.getline(filename);
 
-            user.borrowItem(itemIdentifier, true);
-            std::cout << "Successfully borrowed the item on loan.\n";
+            bookStore.importPurchaseOrder(filename, books, catalogIndex, loanExecutor, out);
         }
         break;
 
-        case 3:
-            user.displayBorrowedItems(books, magazines, journals);
-            break;
+        case 10:
+        {
+            std::string itemIdentifier;
+            in.ignore();
+            out << "Enter the electronic resource identifier: ";
+            in.getline(itemIdentifier);
 
-        case 4:
+            auto it = eresourceIndex.find(itemIdentifier);
+            if (it == eresourceIndex.end())
+            {
+                out << "Item not found.\n";
+                break;
+            }
+
+            auto open = openSessions.find(itemIdentifier);
+            if (open != openSessions.end() && eresources[it->second].isLeaseValid(open->second))
+            {
+                out << "Already open: " << open->second.link << "\n";
+                break;
+            }
+
+            SeatLease lease;
+            if (!eresources[it->second].checkout(lease))
+            {
+                out << "All licensed seats are in use. Try again later.\n";
+                break;
+            }
+            openSessions[itemIdentifier] = lease;
+            out << "Access link: " << lease.link << "\n";
+        }
+        break;
+
+        case 11:
         {
-            std::string username;
-            std::cout << "Enter username: ";
-            std::cin.ignore();
-            std::getline(std::cin, username);
+            std::string itemIdentifier;
+            in.ignore();
+            out << "Enter the electronic resource identifier or access link: ";
+            in.getline(itemIdentifier);
 
-            User newUser(username);
+            // A presented link closes its own seat once its token verifies
+            if (itemIdentifier.find('?') != std::string::npos)
+            {
+                SeatLease lease;
+                auto owner = std::find_if(eresources.begin(), eresources.end(),
+                                          [&](const ElectronicItem &item) { return item.leaseFromLink(itemIdentifier, lease); });
+                if (owner == eresources.end())
+                {
+                    out << "Access link is not valid.\n";
+                    break;
+                }
+                owner->release(lease);
+                auto open = openSessions.find(owner->getIdentifier());
+                if (open != openSessions.end() && open->second.link == lease.link)
+                    openSessions.erase(open);
+                out << "Session closed.\n";
+                break;
+            }
 
-            std::cout << "User registered successfully.\n";
+            auto open = openSessions.find(itemIdentifier);
+            if (open == openSessions.end())
+            {
+                out << "No open session for this resource.\n";
+                break;
+            }
+            eresources[eresourceIndex[itemIdentifier]].release(open->second);
+            openSessions.erase(open);
+            out << "Session closed.\n";
         }
         break;
 
-        case 5:
-            bookStore.purchaseNewBook(books);
+        case 12:
+            browseCatalog(in, out, catalogIndex, books, magazines, journals);
             break;
 
-        case 6:
-            std::cout << "Exiting the program. Goodbye!\n";
+        case 13:
+            printInventoryReport(*reports.snapshot(), catalogIndex, books, magazines, journals, out);
+            break;
+
+        case 14:
+            printLoanReport(*reports.snapshot(), out);
+            break;
+
+        case 15:
+            memoryAccounting().displayReport(out);
+            break;
+
+        case 16:
+            out << "Exiting the program. Goodbye!\n";
             break;
 
         default:
-            std::cout << "Invalid choice. Try again.\n";
-            std::cin.clear();
-            std::cin.ignore(INT_MAX, '\n');
+            out << "Invalid choice. Try again.\n";
+            in.clear();
+            in.ignore(INT_MAX, '\n');
+        }
+    } while (choice != 16);
+
+    in.finish();
+}
+
+// Replays a recorded trace on several independent sessions at once.
+void replayTrace(const std::string &filename, int threadCount, bool paced,
+                 const BookList &books, const MagazineList &magazines, const JournalList &journals,
+                 std::vector<ElectronicItem> &eresources, const LoanPolicyTable &loanPolicies)
+{
+    std::vector<TraceOperation> operations = readTrace(filename);
+    std::string input = traceInput(operations);
+    std::vector<std::vector<long long>> latencies(threadCount);
+
+    ThreadFailure failure;
+    auto session = [&](int index) {
+        failure.guard([&] {
+            // Copied before the session clock starts, so the copy is not in the first latency
+            BookList sessionBooks = books;
+            MagazineList sessionMagazines = magazines;
+            JournalList sessionJournals = journals;
+
+            std::istringstream stream(input);
+            MenuInput in(stream, operations, paced);
+            NullBuffer nullBuffer;
+            std::ostream out(&nullBuffer);
+            runMenu(in, out, std::move(sessionBooks), std::move(sessionMagazines), std::move(sessionJournals), eresources, loanPolicies);
+            latencies[index] = in.getLatencies();
+        });
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i)
+        threads.push_back(std::thread(session, i));
+    for (auto &thread : threads)
+        thread.join();
+    failure.rethrow();
+    auto wallTime = std::chrono::steady_clock::now() - start;
+
+    std::vector<long long> allLatencies;
+    for (const auto &sessionLatencies : latencies)
+        allLatencies.insert(allLatencies.end(), sessionLatencies.begin(), sessionLatencies.end());
+    reportReplay(threadCount, allLatencies, wallTime);
+}
+
+int main(int argc, char *argv[])
+{
+    // Options that come before any other option:
+    // "--lazy-catalog" maps the catalog files and keeps only identifiers and counts
+    // in memory; other fields are decoded when first needed
+    // "--memory-budget MB" stops the program once the tracked containers would use more than MB megabytes
+    bool lazyCatalog = false;
+    while (argc >= 2)
+    {
+        std::string option = argv[1];
+        if (option == "--lazy-catalog")
+        {
+            lazyCatalog = true;
+            --argc;
+            ++argv;
+        }
+        else if (option == "--memory-budget" && argc >= 3)
+        {
+            memoryAccounting().setBudget(std::max(1LL, std::atoll(argv[2])) * 1024 * 1024);
+            argc -= 2;
+            argv += 2;
+        }
+        else
+            break;
+    }
+
+    // "--shards N" partitions the catalog and users across N worker processes.
+    // The catalog is streamed to the workers, so it is not loaded here.
+    if (argc == 3 && std::string(argv[1]) == "--shards")
+    {
+        try
+        {
+            runShardedMode(std::max(1, std::atoi(argv[2])));
+        }
+        catch (const MemoryBudgetExceeded &e)
+        {
+            std::cerr << e.what() << ".\n";
+            memoryAccounting().displayReport(std::cerr);
+            return 1;
+        }
+        return 0;
+    }
+
+    CatalogSource bookSource(CatalogSource::RecordFormat::Book);
+    CatalogSource magazineSource(CatalogSource::RecordFormat::Name);
+    CatalogSource journalSource(CatalogSource::RecordFormat::Name);
+
+    BookList books;
+    MagazineList magazines;
+    JournalList journals;
+    try
+    {
+        if (lazyCatalog)
+        {
+            if (bookSource.open("books.csv"))
+                readBooksLazily(bookSource, books);
+            if (magazineSource.open("magazines.csv"))
+                readNamesLazily(magazineSource, magazines);
+            if (journalSource.open("journals.csv"))
+                readNamesLazily(journalSource, journals);
+        }
+        else
+        {
+            readBooksCSV("books.csv", books);
+            readMagazinesCSV("magazines.csv", magazines);
+            readJournalsCSV("journals.csv", journals);
+        }
+    }
+    catch (const MemoryBudgetExceeded &e)
+    {
+        std::cerr << e.what() << " while loading the catalog.\n";
+        memoryAccounting().displayReport(std::cerr);
+        return 1;
+    }
+
+    std::vector<ElectronicItem> eresources;
+    readEResourcesCSV("eresources.csv", eresources);
+
+    LoanPolicyTable loanPolicies;
+    loanPolicies.load("loan_policies.csv");
+
+    // "--record FILE" writes every menu operation to a trace file
+    MenuInput input(std::cin);
+    if (argc == 3 && std::string(argv[1]) == "--record" && !input.startRecording(argv[2]))
+        return 1;
+
+    // "--replay FILE [THREADS] [--paced]" replays a trace and reports latencies
+    if (argc >= 3 && std::string(argv[1]) == "--replay")
+    {
+        int threadCount = 1;
+        bool paced = false;
+        for (int i = 3; i < argc; ++i)
+        {
+            if (std::string(argv[i]) == "--paced")
+                paced = true;
+            else
+                threadCount = std::max(1, std::atoi(argv[i]));
+        }
+        try
+        {
+            replayTrace(argv[2], threadCount, paced, books, magazines, journals, eresources, loanPolicies);
         }
-    } while (choice != 6);
+        catch (const MemoryBudgetExceeded &e)
+        {
+            std::cerr << e.what() << " during replay.\n";
+            memoryAccounting().displayReport(std::cerr);
+            return 1;
+        }
+        return 0;
+    }
+
+    try
+    {
+        runMenu(input, std::cout, std::move(books), std::move(magazines), std::move(journals), eresources, loanPolicies);
+    }
+    catch (const MemoryBudgetExceeded &e)
+    {
+        std::cerr << e.what() << ".\n";
+        memoryAccounting().displayReport(std::cerr);
+        return 1;
+    }
 
     return 0;
 }